@@ -0,0 +1,95 @@
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "quickfs.h"
+
+/*
+ * Runs one QUICKFS_IOC_BATCH on the root directory of a mounted quickfs,
+ * with one op per argument, and prints each op's result. An op is
+ * create:name[:mode], link:name:target or unlink:name, and ops run in the
+ * order given, so "unlink:a create:a" replaces a with an empty file.
+ */
+
+#define DEFAULT_MODE 0644
+
+static int parse_op(const char *text, struct quickfs_batch_op *op) {
+
+	char copy[3 * MAX_NAME_LENGTH];
+	if (strlen(text) >= sizeof(copy)) return -1;
+	strcpy(copy, text);
+
+	char *arg = copy;
+	char *kind = strsep(&arg, ":");
+	char *name = strsep(&arg, ":");
+	char *extra = strsep(&arg, ":");
+	if (!name || !*name || arg || strlen(name) >= MAX_NAME_LENGTH) return -1;
+
+	memset(op, 0, sizeof(*op));
+	strcpy(op->name, name);
+	if (!strcmp(kind, "create")) {
+		char *end = NULL;
+		op->op = QUICKFS_BATCH_CREATE;
+		op->mode = extra ? strtol(extra, &end, 8) : DEFAULT_MODE;
+		if (extra && (!*extra || *end)) return -1;
+	}
+	else if (!strcmp(kind, "link")) {
+		if (!extra || !*extra || strlen(extra) >= MAX_NAME_LENGTH) return -1;
+		op->op = QUICKFS_BATCH_LINK;
+		strcpy(op->target, extra);
+	}
+	else if (!strcmp(kind, "unlink")) {
+		if (extra) return -1;
+		op->op = QUICKFS_BATCH_UNLINK;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc < 3 || argc - 2 > QUICKFS_BATCH_MAX) goto usage;
+
+	static struct quickfs_batch_op ops[QUICKFS_BATCH_MAX];
+	struct quickfs_batch batch = { ops, argc - 2 };
+	int i;
+	for (i = 0; i < batch.count; ++i) {
+		if (parse_op(argv[i + 2], &ops[i])) {
+			fprintf(stderr, "Bad op %s\n", argv[i + 2]);
+			goto usage;
+		}
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", argv[1]);
+		goto out_error;
+	}
+
+	int done = ioctl(fd, QUICKFS_IOC_BATCH, &batch);
+	if (done < 0) {
+		fprintf(stderr, "Couldn't run the batch: %s\n", strerror(errno));
+		goto out_close;
+	}
+
+	for (i = 0; i < batch.count; ++i) {
+		printf("%s: %s\n", argv[i + 2], ops[i].result ? strerror(-ops[i].result) : "ok");
+	}
+	fprintf(stderr, "%d of %u ops succeeded\n", done, batch.count);
+	close(fd);
+	return done == batch.count ? 0 : 1;
+
+out_close:
+	close(fd);
+out_error:
+	return -1;
+usage:
+	fprintf(stderr, "usage: batchquickfs mountpoint create:name[:mode] | link:name:target | unlink:name ...\n");
+	return -1;
+}
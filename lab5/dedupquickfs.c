@@ -0,0 +1,177 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "quickfs_image.h"
+
+/*
+ * Offline block-level deduplication for unmounted quickfs images. Every
+ * written data block of every uncompressed file is hashed, blocks with the
+ * same hash are compared byte for byte, and the references to each
+ * duplicate are moved to the first copy, whose refcount goes up to match.
+ * The refcounts and inodes reach the disk before any duplicate is cleared
+ * from the bitmap, so an interrupted run can leak blocks but never frees
+ * one that a file still points at.
+ */
+
+struct block_hash {
+	unsigned long long hash;
+	int bit;
+};
+
+static int by_hash(const void *a, const void *b) {
+	const struct block_hash *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return x->bit - y->bit;
+}
+
+// 64-bit FNV-1a
+static unsigned long long hash_block(const unsigned char *data) {
+
+	unsigned long long hash = 14695981039346656037ULL;
+	int i;
+	for (i = 0; i < QUICKFS_BLOCK_SIZE; ++i) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Blocks dedup can touch: written blocks of uncompressed files
+static int dedup_candidate(int ino, const struct quickfs_inode *inode) {
+	return inode_owns_data(ino, inode) && !(inode->flags & QUICKFS_COMPRESS_FL);
+}
+
+int main(int argc, char *argv[]) {
+
+	int dry_run = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		if (opt == 'n') {
+			dry_run = 1;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) goto usage;
+
+	struct quickfs_image image;
+	if (image_open(&image, argv[optind], !dry_run)) goto out_error;
+
+	static struct block_hash hashes[IMAGE_DATA_BITS];
+	static unsigned char seen[IMAGE_DATA_BITS];
+	static int remap[IMAGE_DATA_BITS];
+	unsigned char data[QUICKFS_BLOCK_SIZE], other[QUICKFS_BLOCK_SIZE];
+	int count = 0;
+
+	// Hash every block once, however many files already share it
+	int ino;
+	for (ino = 0; ino < MAX_NUMBER_INODES; ++ino) {
+		struct quickfs_inode inode;
+		if (!bitmap_test(image.inode_bitmap, ino)) continue;
+		if (image_read_inode(&image, ino, &inode)) goto out_close;
+		if (!dedup_candidate(ino, &inode)) continue;
+
+		int i;
+		for (i = 0; i < inode.data_block_count; ++i) {
+			unsigned short entry = inode.data_blocks[i];
+			if (entry == DATA_BLOCK_HOLE || (entry & DATA_BLOCK_UNWRITTEN) || seen[entry]) continue;
+			seen[entry] = 1;
+
+			if (image_read_blocks(&image, DATA_BIT_NUM_TO_BLOCK_NUM(entry), 1, data)) goto out_close;
+			hashes[count].hash = hash_block(data);
+			hashes[count].bit = entry;
+			count++;
+		}
+	}
+	qsort(hashes, count, sizeof(struct block_hash), by_hash);
+
+	// Within each run of equal hashes, fold every identical block into the first
+	int bit;
+	for (bit = 0; bit < IMAGE_DATA_BITS; ++bit) {
+		remap[bit] = -1;
+	}
+	int merged = 0, kept = 0;
+	int i = 0;
+	while (i < count) {
+		int end = i + 1;
+		while (end < count && hashes[end].hash == hashes[i].hash) end++;
+
+		int j;
+		for (j = i; j < end; ++j) {
+			int canonical = hashes[j].bit;
+			if (remap[canonical] >= 0) continue;
+			if (image_read_blocks(&image, DATA_BIT_NUM_TO_BLOCK_NUM(canonical), 1, data)) goto out_close;
+
+			int folded = 0;
+			int k;
+			for (k = j + 1; k < end; ++k) {
+				int duplicate = hashes[k].bit;
+				if (remap[duplicate] >= 0) continue;
+				if (image.refcounts[canonical] + 1 + image.refcounts[duplicate] > MAX_BLOCK_REFCOUNT) continue;
+
+				if (image_read_blocks(&image, DATA_BIT_NUM_TO_BLOCK_NUM(duplicate), 1, other)) goto out_close;
+				if (memcmp(data, other, QUICKFS_BLOCK_SIZE)) continue;
+
+				remap[duplicate] = canonical;
+				image.refcounts[canonical] += 1 + image.refcounts[duplicate];
+				image.refcounts[duplicate] = 0;
+				merged++;
+				folded = 1;
+			}
+			if (folded) kept++;
+		}
+		i = end;
+	}
+
+	printf("%d blocks hashed, %d duplicates of %d distinct blocks\n", count, merged, kept);
+	if (dry_run || !merged) {
+		image_close(&image);
+		return 0;
+	}
+
+	// Point every file at the kept copies before anything is freed
+	if (image_write_refcounts(&image)) goto out_close;
+	for (ino = 0; ino < MAX_NUMBER_INODES; ++ino) {
+		struct quickfs_inode inode;
+		if (!bitmap_test(image.inode_bitmap, ino)) continue;
+		if (image_read_inode(&image, ino, &inode)) goto out_close;
+		if (!dedup_candidate(ino, &inode)) continue;
+
+		int changed = 0;
+		for (i = 0; i < inode.data_block_count; ++i) {
+			unsigned short entry = inode.data_blocks[i];
+			if (entry == DATA_BLOCK_HOLE || (entry & DATA_BLOCK_UNWRITTEN) || remap[entry] < 0) continue;
+			inode.data_blocks[i] = remap[entry];
+			changed = 1;
+		}
+		if (changed && image_write_inode(&image, ino, &inode)) goto out_close;
+	}
+	if (image_sync(&image)) goto out_close;
+
+	for (bit = 0; bit < IMAGE_DATA_BITS; ++bit) {
+		if (remap[bit] < 0) continue;
+		bitmap_clear(image.data_bitmap, bit);
+		image.sb.data_blocks_free++;
+	}
+	if (image_write_bitmaps(&image)) goto out_close;
+	if (image_write_superblock(&image)) goto out_close;
+	if (image_sync(&image)) goto out_close;
+
+	printf("Freed %d blocks\n", merged);
+	image_report_free(&image, stdout);
+
+	image_close(&image);
+	return 0;
+
+out_close:
+	image_close(&image);
+out_error:
+	fprintf(stderr, "Image could not be deduplicated\n");
+	return -1;
+usage:
+	fprintf(stderr, "usage: dedupquickfs [-n] image\n");
+	return -1;
+}
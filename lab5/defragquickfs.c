@@ -0,0 +1,218 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "quickfs_image.h"
+
+/*
+ * Offline defragmenter for unmounted quickfs images. Every fragmented file
+ * is copied into the first free run long enough to hold it, most fragmented
+ * file first. The inode is rewritten to point at the copy before the old
+ * blocks are freed, and an inode is one sector, so an interrupted run leaves
+ * each file either entirely in its old blocks or entirely in its new ones.
+ */
+
+struct candidate {
+	int ino;
+	int runs;
+	int blocks;
+};
+
+static int by_runs(const void *a, const void *b) {
+	const struct candidate *x = a, *y = b;
+	if (x->runs != y->runs) return y->runs - x->runs;
+	return y->blocks - x->blocks;
+}
+
+static int free_run(struct quickfs_image *image, int length) {
+
+	int run_start = 0;
+	int run_length = 0;
+
+	int bit;
+	for (bit = 0; bit < IMAGE_DATA_BITS; ++bit) {
+		if (bitmap_test(image->data_bitmap, bit)) {
+			run_length = 0;
+			continue;
+		}
+		if (run_length++ == 0) run_start = bit;
+		if (run_length == length) return run_start;
+	}
+	return -1;
+}
+
+// Blocks the file actually has, leaving out holes
+static int mapped_blocks(const struct quickfs_inode *inode) {
+
+	int mapped = 0;
+	int i;
+	for (i = 0; i < inode->data_block_count; ++i) {
+		if (inode->data_blocks[i] != DATA_BLOCK_HOLE) mapped++;
+	}
+	return mapped;
+}
+
+/*
+ * Runs of physically contiguous blocks in file order, skipping holes, so a
+ * sparse file whose blocks are already packed together counts as one run
+ */
+static int packed_runs(const struct quickfs_inode *inode) {
+
+	int runs = 0;
+	int last = -1;
+	int i;
+	for (i = 0; i < inode->data_block_count; ++i) {
+		if (inode->data_blocks[i] == DATA_BLOCK_HOLE) continue;
+		int bit = DATA_BLOCK_BIT(inode->data_blocks[i]);
+		if (last < 0 || bit != last + 1) runs++;
+		last = bit;
+	}
+	return runs;
+}
+
+static int defrag_file(struct quickfs_image *image, int ino, struct quickfs_inode *inode, int target) {
+
+	int count = inode->data_block_count;
+	int mapped = mapped_blocks(inode);
+	unsigned char *data = malloc(mapped * QUICKFS_BLOCK_SIZE);
+	if (!data) return -1;
+
+	// Read the old blocks, one read per run. Holes stay holes and take no room in the copy.
+	int i = 0;
+	int next = 0;
+	while (i < count) {
+		if (inode->data_blocks[i] == DATA_BLOCK_HOLE) {
+			i++;
+			continue;
+		}
+		int start = DATA_BLOCK_BIT(inode->data_blocks[i]);
+		int length = 1;
+		while (i + length < count && inode->data_blocks[i + length] != DATA_BLOCK_HOLE &&
+			DATA_BLOCK_BIT(inode->data_blocks[i + length]) == start + length)
+		{
+			length++;
+		}
+		if (image_read_blocks(image, DATA_BIT_NUM_TO_BLOCK_NUM(start), length, data + next * QUICKFS_BLOCK_SIZE)) goto out_error;
+		next += length;
+		i += length;
+	}
+
+	// Claim the new run and write the copy in one go
+	for (i = 0; i < mapped; ++i) {
+		bitmap_set(image->data_bitmap, target + i);
+	}
+	if (image_write_blocks(image, DATA_BIT_NUM_TO_BLOCK_NUM(target), mapped, data)) goto out_error;
+	if (image_write_bitmaps(image) || image_sync(image)) goto out_error;
+
+	// Switch the inode over to the copy
+	unsigned short old_blocks[MAX_DATA_BLOCKS_PER_INODE];
+	memcpy(old_blocks, inode->data_blocks, count * sizeof(unsigned short));
+	next = 0;
+	for (i = 0; i < count; ++i) {
+		if (old_blocks[i] == DATA_BLOCK_HOLE) continue;
+		inode->data_blocks[i] = (target + next++) | (old_blocks[i] & DATA_BLOCK_UNWRITTEN);
+	}
+	if (image_write_inode(image, ino, inode) || image_sync(image)) goto out_error;
+
+	// Only now is it safe to give the old blocks back
+	for (i = 0; i < count; ++i) {
+		if (old_blocks[i] == DATA_BLOCK_HOLE) continue;
+		bitmap_clear(image->data_bitmap, DATA_BLOCK_BIT(old_blocks[i]));
+	}
+	if (image_write_bitmaps(image)) goto out_error;
+
+	free(data);
+	return 0;
+
+out_error:
+	free(data);
+	return -1;
+}
+
+int main(int argc, char *argv[]) {
+
+	int dry_run = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		if (opt == 'n') {
+			dry_run = 1;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) goto usage;
+
+	struct quickfs_image image;
+	if (image_open(&image, argv[optind], !dry_run)) goto out_error;
+
+	printf("Before:\n");
+	image_report_runs(&image, stdout);
+	if (dry_run) {
+		image_close(&image);
+		return 0;
+	}
+
+	// Find every fragmented file
+	struct candidate candidates[MAX_NUMBER_INODES];
+	int count = 0;
+	int ino;
+	for (ino = 0; ino < MAX_NUMBER_INODES; ++ino) {
+		struct quickfs_inode inode;
+		if (!bitmap_test(image.inode_bitmap, ino)) continue;
+		if (image_read_inode(&image, ino, &inode)) goto out_close;
+		if (!inode_owns_data(ino, &inode)) continue;
+
+		// Compressed clusters have holes in their maps and are left alone
+		if (inode.flags & QUICKFS_COMPRESS_FL) continue;
+
+		// Moving a shared block would hand this file a private copy of it
+		if (inode_shares_blocks(&image, &inode)) continue;
+
+		int runs = packed_runs(&inode);
+		if (runs > 1) {
+			candidates[count].ino = ino;
+			candidates[count].runs = runs;
+			candidates[count].blocks = mapped_blocks(&inode);
+			count++;
+		}
+	}
+	qsort(candidates, count, sizeof(struct candidate), by_runs);
+
+	int moved = 0, skipped = 0;
+	int i;
+	for (i = 0; i < count; ++i) {
+		struct quickfs_inode inode;
+		if (image_read_inode(&image, candidates[i].ino, &inode)) goto out_close;
+
+		int target = free_run(&image, mapped_blocks(&inode));
+		if (target < 0) {
+			skipped++;
+			continue;
+		}
+		if (defrag_file(&image, candidates[i].ino, &inode, target)) {
+			fprintf(stderr, "Couldn't move inode %d\n", candidates[i].ino);
+			goto out_close;
+		}
+		moved++;
+	}
+	if (image_sync(&image)) goto out_close;
+
+	printf("Moved %d of %d fragmented files", moved, count);
+	if (skipped) printf(", %d had no free run long enough", skipped);
+	printf("\nAfter:\n");
+	image_report_runs(&image, stdout);
+
+	image_close(&image);
+	return 0;
+
+out_close:
+	image_close(&image);
+out_error:
+	fprintf(stderr, "Image could not be defragmented\n");
+	return -1;
+usage:
+	fprintf(stderr, "usage: defragquickfs [-n] image\n");
+	return -1;
+}
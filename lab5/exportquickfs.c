@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "quickfs_image.h"
+
+/*
+ * Streams every file on an unmounted quickfs image into a tar archive on
+ * stdout (-t) or into a host directory (-C dir). File data is moved from
+ * the image to the output with copy_file_range or sendfile, one call per run
+ * of adjacent data blocks, so it never passes through this process. Only
+ * compressed clusters have to be read in, to be inflated. A second name for
+ * an inode, whether a hard link record or the primary inode itself, is
+ * emitted as a link to the first name, not as another copy.
+ */
+
+static int use_copy_file_range = 1;
+static int use_sendfile = 1;
+static const unsigned char zeros[QUICKFS_BLOCK_SIZE];
+
+static int write_all(int fd, const void *buf, size_t length) {
+
+	const char *p = buf;
+	while (length) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int write_zeros(int fd, size_t length) {
+
+	while (length) {
+		size_t chunk = length < QUICKFS_BLOCK_SIZE ? length : QUICKFS_BLOCK_SIZE;
+		if (write_all(fd, zeros, chunk)) return -1;
+		length -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Moves length bytes at offset in the image to the current position of
+ * out_fd, in the kernel whenever the output allows it
+ */
+static int stream_range(int in_fd, off_t offset, int out_fd, size_t length) {
+
+	while (length) {
+		ssize_t n;
+		if (use_copy_file_range) {
+			n = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+			if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				use_copy_file_range = 0;
+				continue;
+			}
+		}
+		else if (use_sendfile) {
+			n = sendfile(out_fd, in_fd, &offset, length);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				use_sendfile = 0;
+				continue;
+			}
+		}
+		else {
+			char buf[64 * 1024];
+			n = pread(in_fd, buf, length < sizeof(buf) ? length : sizeof(buf), offset);
+			if (n > 0) {
+				if (write_all(out_fd, buf, n)) return -1;
+				offset += n;
+			}
+		}
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * Writes the file's size bytes. Holes and unwritten blocks become zeros,
+ * or are skipped over when the output is a sparse-capable file.
+ */
+static int stream_file(struct quickfs_image *image, const struct quickfs_inode *inode, int out_fd, int seekable) {
+
+	unsigned long size = inode->size;
+	unsigned long pos = 0;
+
+	if (inode->flags & QUICKFS_COMPRESS_FL) {
+		unsigned char compressed[QUICKFS_CLUSTER_SIZE];
+		unsigned char cluster[QUICKFS_CLUSTER_SIZE];
+		int first;
+		for (first = 0; pos < size; first += QUICKFS_CLUSTER_BLOCKS) {
+			int count = 0;
+			while (count < QUICKFS_CLUSTER_BLOCKS && first + count < inode->data_block_count &&
+				inode->data_blocks[first + count] != DATA_BLOCK_HOLE)
+			{
+				count++;
+			}
+
+			unsigned long chunk = size - pos < QUICKFS_CLUSTER_SIZE ? size - pos : QUICKFS_CLUSTER_SIZE;
+			if (count == 0) {
+				if (write_zeros(out_fd, chunk)) return -1;
+			}
+			else {
+				int i;
+				for (i = 0; i < count; ++i) {
+					if (image_read_blocks(image, DATA_BIT_NUM_TO_BLOCK_NUM(inode->data_blocks[first + i]), 1,
+						(count == QUICKFS_CLUSTER_BLOCKS ? cluster : compressed) + i * QUICKFS_BLOCK_SIZE)) return -1;
+				}
+				if (count < QUICKFS_CLUSTER_BLOCKS) {
+					uLongf length = QUICKFS_CLUSTER_SIZE;
+					memset(cluster, 0, QUICKFS_CLUSTER_SIZE);
+					if (uncompress(cluster, &length, compressed, count * QUICKFS_BLOCK_SIZE) != Z_OK) {
+						errno = EIO;
+						return -1;
+					}
+				}
+				if (write_all(out_fd, cluster, chunk)) return -1;
+			}
+			pos += chunk;
+		}
+		return 0;
+	}
+
+	int i = 0;
+	while (pos < size) {
+		unsigned long entry = i < inode->data_block_count ? inode->data_blocks[i] : DATA_BLOCK_HOLE;
+
+		// Merge this entry with every physically adjacent one after it
+		int length = 1;
+		if (entry != DATA_BLOCK_HOLE && !(entry & DATA_BLOCK_UNWRITTEN)) {
+			while (i + length < inode->data_block_count &&
+				inode->data_blocks[i + length] == entry + length &&
+				(pos + (unsigned long) length * QUICKFS_BLOCK_SIZE) < size)
+			{
+				length++;
+			}
+		}
+
+		unsigned long bytes = (unsigned long) length * QUICKFS_BLOCK_SIZE;
+		if (bytes > size - pos) bytes = size - pos;
+
+		if (entry == DATA_BLOCK_HOLE || (entry & DATA_BLOCK_UNWRITTEN)) {
+			if (seekable) {
+				if (lseek(out_fd, bytes, SEEK_CUR) < 0) return -1;
+			}
+			else if (write_zeros(out_fd, bytes)) {
+				return -1;
+			}
+		}
+		else {
+			off_t offset = (off_t) DATA_BIT_NUM_TO_BLOCK_NUM(entry) * QUICKFS_BLOCK_SIZE;
+			if (stream_range(image->fd, offset, out_fd, bytes)) return -1;
+		}
+
+		pos += bytes;
+		i += length;
+	}
+
+	// A trailing hole has to be made part of the file explicitly
+	if (seekable && ftruncate(out_fd, size)) return -1;
+	return 0;
+}
+
+/*
+	Tar output
+*/
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+static int write_tar_header(int fd, const char *name, char typeflag, const char *linkname,
+	const struct quickfs_inode *inode, unsigned long size)
+{
+	struct tar_header header;
+	memset(&header, 0, sizeof(header));
+
+	strncpy(header.name, name, sizeof(header.name));
+	snprintf(header.mode, sizeof(header.mode), "%07o", inode ? inode->umode & 07777 : 0644);
+	snprintf(header.uid, sizeof(header.uid), "%07o", inode ? inode->uid : 0);
+	snprintf(header.gid, sizeof(header.gid), "%07o", inode ? inode->gid : 0);
+	snprintf(header.size, sizeof(header.size), "%011lo", size);
+	snprintf(header.mtime, sizeof(header.mtime), "%011lo", inode ? (unsigned long) inode->mtime.tv_sec : 0);
+	header.typeflag = typeflag;
+	if (linkname) strncpy(header.linkname, linkname, sizeof(header.linkname));
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+
+	memset(header.checksum, ' ', sizeof(header.checksum));
+	unsigned int checksum = 0;
+	unsigned int i;
+	for (i = 0; i < sizeof(header); ++i) {
+		checksum += ((unsigned char *) &header)[i];
+	}
+	snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+	header.checksum[7] = ' ';
+
+	return write_all(fd, &header, sizeof(header));
+}
+
+// Names that don't fit in a ustar header go in a GNU long name record first
+static int write_long_name(int fd, char typeflag, const char *name) {
+
+	size_t length = strlen(name) + 1;
+	if (length <= 100) return 0;
+
+	if (write_tar_header(fd, "././@LongLink", typeflag, NULL, NULL, length)) return -1;
+	if (write_all(fd, name, length)) return -1;
+	return write_zeros(fd, (QUICKFS_BLOCK_SIZE - length % QUICKFS_BLOCK_SIZE) % QUICKFS_BLOCK_SIZE);
+}
+
+static int tar_file(struct quickfs_image *image, const char *name, const struct quickfs_inode *inode) {
+
+	if (write_long_name(STDOUT_FILENO, 'L', name)) return -1;
+	if (write_tar_header(STDOUT_FILENO, name, '0', NULL, inode, inode->size)) return -1;
+	if (stream_file(image, inode, STDOUT_FILENO, 0)) return -1;
+	return write_zeros(STDOUT_FILENO, (QUICKFS_BLOCK_SIZE - inode->size % QUICKFS_BLOCK_SIZE) % QUICKFS_BLOCK_SIZE);
+}
+
+static int tar_link(const char *name, const char *target, const struct quickfs_inode *inode) {
+
+	if (write_long_name(STDOUT_FILENO, 'K', target)) return -1;
+	if (write_long_name(STDOUT_FILENO, 'L', name)) return -1;
+	return write_tar_header(STDOUT_FILENO, name, '1', target, inode, 0);
+}
+
+/*
+	Directory output
+*/
+
+static int extract_file(struct quickfs_image *image, int dir_fd, const char *name, const struct quickfs_inode *inode) {
+
+	int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, inode->umode & 07777);
+	if (fd < 0) return -1;
+
+	int ret = stream_file(image, inode, fd, 1);
+	if (!ret) {
+		struct timespec times[2] = { inode->atime, inode->mtime };
+		futimens(fd, times);
+		if (fchown(fd, inode->uid, inode->gid)) {
+			// Only root can give files away; keep our own ownership otherwise
+		}
+	}
+	if (close(fd)) ret = -1;
+	return ret;
+}
+
+static int extract_link(int dir_fd, const char *name, const char *target) {
+	return linkat(dir_fd, target, dir_fd, name, 0);
+}
+
+int main(int argc, char *argv[]) {
+
+	const char *directory = NULL;
+	int to_tar = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "tC:")) != -1) {
+		if (opt == 't') {
+			to_tar = 1;
+		}
+		else if (opt == 'C') {
+			directory = optarg;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || to_tar == !!directory) goto usage;
+	if (to_tar && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "Refusing to write a tar archive to a terminal\n");
+		goto usage;
+	}
+
+	struct quickfs_image image;
+	if (image_open(&image, argv[optind], 0)) goto out_error;
+
+	int dir_fd = -1;
+	if (directory) {
+		dir_fd = open(directory, O_RDONLY | O_DIRECTORY);
+		if (dir_fd < 0) {
+			fprintf(stderr, "Couldn't open directory %s\n", directory);
+			goto out_close;
+		}
+	}
+
+	// The first name each data-owning inode was emitted under
+	static char emitted[MAX_NUMBER_INODES][MAX_NAME_LENGTH];
+	unsigned long files = 0, links = 0;
+
+	int ino;
+	for (ino = 1; ino < MAX_NUMBER_INODES; ++ino) {
+		struct quickfs_inode entry;
+		if (!bitmap_test(image.inode_bitmap, ino)) continue;
+		if (image_read_inode(&image, ino, &entry)) goto out_close;
+		entry.name[MAX_NAME_LENGTH - 1] = '\0';
+
+		// A primary inode whose own name was unlinked lives on through its links
+		if (entry.name[0] == '\0') continue;
+
+		int target = entry.link > 0 ? entry.link : ino;
+		if (target >= MAX_NUMBER_INODES) continue;
+
+		struct quickfs_inode inode;
+		if (target == ino) {
+			inode = entry;
+		}
+		else if (image_read_inode(&image, target, &inode)) {
+			goto out_close;
+		}
+
+		int ret;
+		if (emitted[target][0]) {
+			ret = to_tar ? tar_link(entry.name, emitted[target], &inode) :
+				extract_link(dir_fd, entry.name, emitted[target]);
+			links++;
+		}
+		else {
+			ret = to_tar ? tar_file(&image, entry.name, &inode) :
+				extract_file(&image, dir_fd, entry.name, &inode);
+			strcpy(emitted[target], entry.name);
+			files++;
+		}
+		if (ret) {
+			fprintf(stderr, "Couldn't export %s: %s\n", entry.name, strerror(errno));
+			goto out_close;
+		}
+	}
+
+	// End of archive
+	if (to_tar && write_zeros(STDOUT_FILENO, 2 * QUICKFS_BLOCK_SIZE)) goto out_close;
+
+	fprintf(stderr, "Exported %lu files and %lu hard links\n", files, links);
+	if (dir_fd >= 0) close(dir_fd);
+	image_close(&image);
+	return 0;
+
+out_close:
+	if (dir_fd >= 0) close(dir_fd);
+	image_close(&image);
+out_error:
+	fprintf(stderr, "Image could not be exported\n");
+	return -1;
+usage:
+	fprintf(stderr, "usage: exportquickfs -t image > archive.tar\n"
+			"       exportquickfs -C directory image\n");
+	return -1;
+}
@@ -12,10 +12,13 @@
 #define INODE_BITMAP_POS (INODE_BITMAP_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
 #define DATA_BITMAP_POS (FIRST_DATA_BITMAP_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
 #define INODES_POS (FIRST_INODE_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
+#define JOURNAL_POS (FIRST_JOURNAL_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
+#define REFCOUNT_POS (FIRST_REFCOUNT_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
+#define NAME_TABLE_POS (FIRST_NAME_TABLE_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
 #define DATA_POS (FIRST_DATA_BLOCK_NUM * QUICKFS_BLOCK_SIZE)
 
 inline int bytes_to_data_blocks(unsigned long bytes) {
-	return (((int) bytes) - (4102 * QUICKFS_BLOCK_SIZE)) / QUICKFS_BLOCK_SIZE;
+	return (((int) bytes) - (FIRST_DATA_BLOCK_NUM * QUICKFS_BLOCK_SIZE)) / QUICKFS_BLOCK_SIZE;
 }
 
 int write_superblock(FILE *file, unsigned long size) {
@@ -140,6 +143,7 @@ int write_root_inode(FILE *file) {
 	inode.size = 0;
 	inode.data_block_count = 0;
 	inode.hard_links = 1;
+	inode.flags = 0;
 	inode.link = -1;
 	inode.uid = getuid();
 	inode.gid = getgid();
@@ -158,6 +162,84 @@ out:
 	return ret;
 }
 
+int write_journal(FILE *file) {
+
+	int ret = 0;
+	if (ret = fseek(file, JOURNAL_POS, SEEK_SET)) goto out;
+
+	/*
+	 * Zero the whole log so stale blocks from an earlier filesystem
+	 * on the image can never be mistaken for a committed transaction
+	 */
+	unsigned char block[QUICKFS_BLOCK_SIZE];
+	memset(block, 0, QUICKFS_BLOCK_SIZE);
+
+	struct quickfs_journal_sb *jsb = (struct quickfs_journal_sb *) block;
+	jsb->magic_number = JOURNAL_MAGIC_NUMBER;
+	jsb->sequence = 1;
+	jsb->start = 0;
+	if (fwrite(block, sizeof(unsigned char), QUICKFS_BLOCK_SIZE, file) != QUICKFS_BLOCK_SIZE) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(block, 0, QUICKFS_BLOCK_SIZE);
+	int i;
+	for (i = 1; i < NUM_JOURNAL_BLOCKS; ++i) {
+		if (fwrite(block, sizeof(unsigned char), QUICKFS_BLOCK_SIZE, file) != QUICKFS_BLOCK_SIZE) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	return ret;
+}
+
+int write_refcounts(FILE *file) {
+
+	int ret = 0;
+	if (ret = fseek(file, REFCOUNT_POS, SEEK_SET)) goto out;
+
+	// No data block starts out shared
+	unsigned char block[QUICKFS_BLOCK_SIZE];
+	memset(block, 0, QUICKFS_BLOCK_SIZE);
+	int i;
+	for (i = 0; i < NUM_REFCOUNT_BLOCKS; ++i) {
+		if (fwrite(block, sizeof(unsigned char), QUICKFS_BLOCK_SIZE, file) != QUICKFS_BLOCK_SIZE) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	return ret;
+}
+
+int write_name_table(FILE *file) {
+
+	int ret = 0;
+	if (ret = fseek(file, NAME_TABLE_POS, SEEK_SET)) goto out;
+
+	// The root inode is never looked up by name, so every slot starts empty
+	struct quickfs_name_entry entries[NAME_ENTRIES_PER_BLOCK];
+	int i;
+	for (i = 0; i < NAME_ENTRIES_PER_BLOCK; ++i) {
+		entries[i].hash = 0;
+		entries[i].ino = NAME_TABLE_EMPTY;
+		entries[i].reserved = 0;
+	}
+	for (i = 0; i < NUM_NAME_TABLE_BLOCKS; ++i) {
+		if (fwrite(entries, sizeof(entries), 1, file) != 1) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	return ret;
+}
+
 int main(int argc, char *argv[]) {
 
 	if (argc != 2){
@@ -198,6 +280,18 @@ int main(int argc, char *argv[]) {
 	if (write_root_inode(file)) goto out_error;
 	printf("root inode written\n");
 
+	// Write empty journal
+	if (write_journal(file)) goto out_error;
+	printf("journal written\n");
+
+	// Write empty refcount table
+	if (write_refcounts(file)) goto out_error;
+	printf("refcounts written\n");
+
+	// Write empty name table
+	if (write_name_table(file)) goto out_error;
+	printf("name table written\n");
+
 	fclose(file);
 
 	printf("./mkquickfs: created quickfs filesystem on '%s'\n", argv[1]);
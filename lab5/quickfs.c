@@ -3,6 +3,18 @@
 #include <linux/buffer_head.h>
 #include <linux/namei.h>
 #include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/crc32.h>
+#include <linux/zlib.h>
+#include <linux/vmalloc.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/parser.h>
+#include <linux/security.h>
+#include <linux/spinlock.h>
+#include <linux/time.h>
+#include <asm/uaccess.h>
 
 #include "quickfs.h"
 
@@ -10,6 +22,83 @@ static int quickfs_create(struct inode *, struct dentry *, int, struct nameidata
 struct dentry *quickfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nameidata);
 static int quickfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry);
 static int quickfs_unlink(struct inode *dir, struct dentry *dentry);
+static void quickfs_truncate(struct inode *inode);
+static int quickfs_batch(struct inode *dir, struct file *file, struct quickfs_batch __user *arg);
+static struct address_space_operations quickfs_addr_space_ops;
+static struct address_space_operations quickfs_compressed_addr_space_ops;
+
+/*
+	In-memory superblock
+*/
+
+#define JOURNAL_MAX_TRANSACTION_BLOCKS JOURNAL_TAGS_PER_DESCRIPTOR
+// Freeing a file's blocks can touch every refcount block on top of the usual few
+#define JOURNAL_MAX_HANDLE_BLOCKS (8 + NUM_REFCOUNT_BLOCKS)
+#define JOURNAL_COMMIT_INTERVAL (5 * HZ)
+
+struct quickfs_journal {
+	struct super_block *sb;
+	struct semaphore lock;
+
+	unsigned long sequence;		// Sequence number of the running transaction
+	unsigned long head;		// Log block the running transaction will be written to
+
+	// Metadata buffers changed by the running transaction
+	int count;
+	struct buffer_head *buffers[JOURNAL_MAX_TRANSACTION_BLOCKS];
+	struct buffer_head *log[JOURNAL_MAX_TRANSACTION_BLOCKS + 2];
+
+	int commit_scheduled;
+	struct work_struct commit_work;
+};
+
+#define QUICKFS_TRACE_RECORDS 4096
+
+struct quickfs_trace {
+	spinlock_t lock;
+	struct quickfs_trace_record *records;
+	unsigned int head;		// Oldest record
+	unsigned int count;
+	unsigned int dropped;
+};
+
+#define QUICKFS_LAZYTIME_EXPIRE (60 * HZ)
+#define QUICKFS_LAZYTIME_BATCH 64
+
+struct quickfs_sb_info {
+	struct quickfs_sb disk_sb;
+	struct quickfs_journal journal;
+	struct quickfs_trace *trace;	// NULL unless mounted with -o trace
+	unsigned long shared_blocks;	// Data blocks with a nonzero refcount
+
+	// Inodes whose timestamps are newer in memory than on disk, under -o lazytime
+	int lazytime;
+	spinlock_t lazy_lock;
+	struct list_head lazy_inodes;
+	int lazy_scheduled;
+	struct work_struct lazy_work;
+};
+
+#define QUICKFS_SB(sb) ((struct quickfs_sb_info *) (sb)->s_fs_info)
+
+/*
+	In-memory inode
+*/
+
+struct quickfs_inode_info {
+	// The fields other than timestamps as last written to the disk inode
+	loff_t disk_size;
+	umode_t disk_mode;
+	uid_t disk_uid;
+	gid_t disk_gid;
+	unsigned int disk_nlink;
+
+	struct list_head lazy_list;	// On lazy_inodes, holding a reference, while timestamps are held back
+	unsigned long lazy_since;	// When they started being held back
+	struct inode vfs_inode;
+};
+
+#define QUICKFS_I(inode) container_of(inode, struct quickfs_inode_info, vfs_inode)
 
 /*
 	Utility functions
@@ -44,6 +133,23 @@ static int first_free_bit(struct buffer_head **buffers, unsigned long size) {
 	return -1;
 }
 
+// Collects up to count free bits of one bitmap block in a single pass
+static int free_bits(struct buffer_head *bh, int *bits, int count) {
+
+	unsigned char *bitmap = (unsigned char *) bh->b_data;
+
+	int found = 0;
+	int i;
+	for (i = 0; i < QUICKFS_BLOCK_SIZE * 8 && found < count; ++i) {
+		if (bitmap[i / 8] == 0xFF) {
+			i += 7;
+			continue;
+		}
+		if (!(bitmap[i / 8] & (0x80 >> (i % 8)))) bits[found++] = i;
+	}
+	return found;
+}
+
 static void clear_bitmap_bit(struct buffer_head *bh, int index) {
 
 	unsigned char *bitmap = (unsigned char *) bh->b_data;
@@ -69,258 +175,2055 @@ static int test_for_bit(struct buffer_head *bh, int index) {
 	return !!(byte & (0x80 >> (index % 8)));
 }
 
-static int quickfs_write_inode(struct inode *inode, int unused) {
+static int first_free_run(struct buffer_head **buffers, unsigned long size, int length) {
 
-	unsigned long inode_num = inode->i_ino;
-	if (inode_num < ROOT_INODE_NUM || inode_num > 4095) {
-		return -EIO;
+	int run_start = 0;
+	int run_length = 0;
+
+	int bit;
+	for (bit = 0; bit < size * QUICKFS_BLOCK_SIZE * 8; ++bit) {
+		if (test_for_bit(buffers[bit / (QUICKFS_BLOCK_SIZE * 8)], bit % (QUICKFS_BLOCK_SIZE * 8))) {
+			run_length = 0;
+			continue;
+		}
+		if (run_length++ == 0) run_start = bit;
+		if (run_length == length) return run_start;
 	}
 
-	struct buffer_head *bh = sb_bread(inode->i_sb, INODE_NUM_TO_BLOCK_NUM(inode_num));
+	// No run of free bits is long enough
+	return -1;
+}
+
+/*
+	Journal
+
+	Every operation that changes metadata brackets its changes with
+	quickfs_journal_start/quickfs_journal_stop, and hands each buffer it
+	changed to quickfs_journal_dirty instead of marking it dirty. The
+	buffers are held in memory until the running transaction commits,
+	which happens JOURNAL_COMMIT_INTERVAL after the first change, when
+	the transaction fills up, or on sync. A commit is one sequential write
+	of the whole transaction into the log, after which the buffers are
+	written back to their home locations in block order.
+*/
+
+static int quickfs_journal_commit(struct quickfs_journal *journal);
+
+static int quickfs_write_journal_sb(struct super_block *sb, unsigned long sequence, unsigned long start) {
+
+	struct buffer_head *bh = sb_bread(sb, JOURNAL_SUPER_BLOCK_NUM);
 	if (!bh) {
 		return -EIO;
 	}
 
-	struct quickfs_inode *disk_inode = (struct quickfs_inode *) bh->b_data;
-	if (!disk_inode) {
-		return -1;
-	}
-
-	disk_inode->umode = inode->i_mode;
-	disk_inode->uid = inode->i_uid;
-	disk_inode->gid = inode->i_gid;
-	disk_inode->data_block_count = inode->i_blocks;
-	disk_inode->size = inode->i_size;
-	disk_inode->hard_links = inode->i_nlink;
-	disk_inode->atime = inode->i_atime;
-	disk_inode->mtime = inode->i_mtime;
-	disk_inode->ctime = inode->i_ctime;
-	
+	struct quickfs_journal_sb *jsb = (struct quickfs_journal_sb *) bh->b_data;
+	jsb->sequence = sequence;
+	jsb->start = start;
 	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+
+	int ret = buffer_uptodate(bh) ? 0 : -EIO;
 	brelse(bh);
-	return 0;
+	return ret;
 }
 
-static void quickfs_delete_inode(struct inode *inode) {
+static void quickfs_journal_start(struct super_block *sb) {
 
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *super_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
-	struct buffer_head *inode_bitmap_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
-	struct buffer_head *data_bitmap[NUM_DATA_BITMAP_BLOCKS];
-	int block;
-	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
-		data_bitmap[block] = sb_bread(sb, FIRST_DATA_BITMAP_BLOCK_NUM + block);
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
+
+	down(&journal->lock);
+
+	// Make sure everything this handle dirties fits in the running transaction
+	if (journal->count + JOURNAL_MAX_HANDLE_BLOCKS > JOURNAL_MAX_TRANSACTION_BLOCKS) {
+		quickfs_journal_commit(journal);
 	}
-	struct buffer_head *inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+}
 
-	struct quickfs_inode *disk_inode = (struct quickfs_inode *) inode_bh->b_data;
-	unsigned short data_block_count = disk_inode->data_block_count;
-	unsigned short data_blocks[data_block_count];
-	memcpy(data_blocks, disk_inode->data_blocks, data_block_count * sizeof(unsigned short));
-	brelse(inode_bh);
+static void quickfs_journal_dirty(struct super_block *sb, struct buffer_head *bh) {
+
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
 
 	int i;
-	for (i = 0; i < data_block_count; ++i) {
-		int data_block = data_blocks[i];
-		int block = DATA_BIT_TO_DATA_BITMAP_BLOCK(data_block);
-		int index = DATA_BIT_TO_INDEX(data_block);
-		clear_bitmap_bit(data_bitmap[block], index);
-		mark_buffer_dirty(data_bitmap[block]);
+	for (i = 0; i < journal->count; ++i) {
+		if (journal->buffers[i] == bh) return;
 	}
-	
-	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
-		brelse(data_bitmap[block]);
+
+	BUG_ON(journal->count >= JOURNAL_MAX_TRANSACTION_BLOCKS);
+	get_bh(bh);
+	journal->buffers[journal->count++] = bh;
+}
+
+static void quickfs_journal_stop(struct super_block *sb) {
+
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
+
+	if (journal->count && !journal->commit_scheduled) {
+		journal->commit_scheduled = 1;
+		schedule_delayed_work(&journal->commit_work, JOURNAL_COMMIT_INTERVAL);
 	}
 
-	clear_bitmap_bit(inode_bitmap_bh, inode->i_ino);
-	mark_buffer_dirty(inode_bitmap_bh);
-	brelse(inode_bitmap_bh);
+	up(&journal->lock);
+}
 
-	struct quickfs_sb *disk_sb = (struct quickfs_sb *) super_bh->b_data;
-	disk_sb->data_blocks_free += data_block_count;
-	disk_sb->inodes_free += 1;
-	mark_buffer_dirty(super_bh);
-	brelse(super_bh);
+static struct buffer_head *quickfs_journal_getblk(struct super_block *sb, unsigned long log_block) {
 
-	clear_inode(inode);
+	struct buffer_head *bh = sb_getblk(sb, JOURNAL_LOG_TO_BLOCK_NUM(log_block));
+	lock_buffer(bh);
+	memset(bh->b_data, 0, QUICKFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	return bh;
 }
 
+static void quickfs_sort_buffers(struct buffer_head **buffers, int count) {
 
-static int quickfs_readdir(struct file *file, void *dirent, filldir_t filldir) {
+	int i, j;
+	for (i = 1; i < count; ++i) {
+		struct buffer_head *bh = buffers[i];
+		for (j = i; j > 0 && buffers[j - 1]->b_blocknr > bh->b_blocknr; --j) {
+			buffers[j] = buffers[j - 1];
+		}
+		buffers[j] = bh;
+	}
+}
 
-     struct inode * dir = file->f_dentry->d_inode;
-     struct dentry * de;
- 
-     if (file->f_pos) {
-         return 1;
-     }
+/*
+ * Called with the journal lock held
+ */
+static int quickfs_journal_commit(struct quickfs_journal *journal) {
 
-	de = file->f_dentry;
-	
-	if (filldir(dirent, ".", 1, file->f_pos++, 4096, DT_REG)) return 1;
-	if (filldir(dirent, "..", 2, file->f_pos++, 4097, DT_REG)) {
-		return 1;
+	struct super_block *sb = journal->sb;
+	int count = journal->count;
+	int ret = 0;
+	int i;
+
+	if (!count) {
+		return 0;
 	}
 
-	int ino = 1;
-	struct buffer_head *inode_bitmap_bh = sb_bread(dir->i_sb, INODE_BITMAP_BLOCK_NUM);
-	do {
-		if (test_for_bit(inode_bitmap_bh, ino)){
-			struct buffer_head *disk_inode_bh = sb_bread(dir->i_sb, INODE_NUM_TO_BLOCK_NUM(ino));	
-			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
-			int j;
+	/*
+	 * Transactions never wrap past the end of the log. Every transaction
+	 * before this one has already been checkpointed, so we can start over
+	 * at the front of the log as long as replay knows to start there too.
+	 */
+	if (journal->head + count + 2 > NUM_JOURNAL_BLOCKS) {
+		journal->head = 1;
+		ret = quickfs_write_journal_sb(sb, journal->sequence, journal->head);
+		if (ret) goto checkpoint;
+	}
 
-			char *name  = disk_inode->name;
-			int size = strnlen(name, MAX_NAME_LENGTH);
-			if (strcmp(name, "") == 0) {
-				brelse(disk_inode_bh);
-				ino++;
-				continue;
-			}
-			int corresponding_ino = ino;
-			if (disk_inode->link > 0) {
-				corresponding_ino = disk_inode->link;
-			}
-			if (filldir(dirent, name, size, file->f_pos++, corresponding_ino, DT_REG) < 0){
-				brelse(disk_inode_bh);
-				return 0;
-			}
-			brelse(disk_inode_bh);
-		}
-		ino++;
-		
-	} while (ino < 8*QUICKFS_BLOCK_SIZE);
-	brelse(inode_bitmap_bh);
-	return 1;  
+	// Descriptor block
+	struct buffer_head *desc_bh = quickfs_journal_getblk(sb, journal->head);
+	struct quickfs_journal_descriptor *desc = (struct quickfs_journal_descriptor *) desc_bh->b_data;
+	desc->header.magic_number = JOURNAL_MAGIC_NUMBER;
+	desc->header.type = JOURNAL_DESCRIPTOR_BLOCK;
+	desc->header.sequence = journal->sequence;
+	desc->header.count = count;
+	for (i = 0; i < count; ++i) {
+		desc->block_nums[i] = journal->buffers[i]->b_blocknr;
+	}
+	u32 checksum = crc32_le(~0, (unsigned char *) desc_bh->b_data, QUICKFS_BLOCK_SIZE);
+	journal->log[0] = desc_bh;
+
+	// A copy of every changed block
+	for (i = 0; i < count; ++i) {
+		struct buffer_head *copy_bh = quickfs_journal_getblk(sb, journal->head + 1 + i);
+		memcpy(copy_bh->b_data, journal->buffers[i]->b_data, QUICKFS_BLOCK_SIZE);
+		checksum = crc32_le(checksum, (unsigned char *) copy_bh->b_data, QUICKFS_BLOCK_SIZE);
+		journal->log[1 + i] = copy_bh;
+	}
+
+	/*
+	 * The commit block carries a checksum of the whole transaction, so
+	 * the transaction can go to disk in a single write and replay can
+	 * still tell whether all of it made it
+	 */
+	struct buffer_head *commit_bh = quickfs_journal_getblk(sb, journal->head + 1 + count);
+	struct quickfs_journal_commit *commit = (struct quickfs_journal_commit *) commit_bh->b_data;
+	commit->header.magic_number = JOURNAL_MAGIC_NUMBER;
+	commit->header.type = JOURNAL_COMMIT_BLOCK;
+	commit->header.sequence = journal->sequence;
+	commit->header.count = count;
+	commit->checksum = checksum;
+	journal->log[1 + count] = commit_bh;
+
+	ll_rw_block(WRITE, count + 2, journal->log);
+	for (i = 0; i < count + 2; ++i) {
+		wait_on_buffer(journal->log[i]);
+		if (!buffer_uptodate(journal->log[i])) ret = -EIO;
+		brelse(journal->log[i]);
+	}
+
+checkpoint:
+	if (ret) {
+		printk(KERN_ERR "quickfs: couldn't log transaction %lu, writing it back unjournaled\n",
+			journal->sequence);
+	}
+
+	// Write the changed blocks back to their home locations
+	quickfs_sort_buffers(journal->buffers, count);
+	for (i = 0; i < count; ++i) {
+		mark_buffer_dirty(journal->buffers[i]);
+	}
+	ll_rw_block(WRITE, count, journal->buffers);
+	for (i = 0; i < count; ++i) {
+		wait_on_buffer(journal->buffers[i]);
+		if (!buffer_uptodate(journal->buffers[i])) ret = -EIO;
+		brelse(journal->buffers[i]);
+	}
+
+	journal->head += count + 2;
+	journal->sequence++;
+	journal->count = 0;
+	return ret;
 }
 
+static void quickfs_journal_commit_work(void *data) {
 
-static struct inode_operations quickfs_inode_ops = {
-	.create = quickfs_create,
-	.lookup = quickfs_lookup, 
-	.link = quickfs_link,
-	.unlink = quickfs_unlink
-};
+	struct quickfs_journal *journal = (struct quickfs_journal *) data;
 
-static int quickfs_get_block(struct inode * inode, sector_t block, struct buffer_head * bh_result, int create){
+	down(&journal->lock);
+	journal->commit_scheduled = 0;
+	quickfs_journal_commit(journal);
+	up(&journal->lock);
+}
 
-	struct super_block *sb = inode->i_sb;
+static void quickfs_journal_sync(struct super_block *sb) {
 
-	switch(create) {
-		case 0: {
-			struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
-			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
-			
-			if (block >= disk_inode->data_block_count) {
-				brelse(disk_inode_bh);
-				return 0;
-			}
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
 
-			short data_block = disk_inode->data_blocks[block];
-			map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_block));
+	down(&journal->lock);
+	quickfs_journal_commit(journal);
+	up(&journal->lock);
+}
 
-			brelse(disk_inode_bh);
-			return 0;
+/*
+ * Replays every committed transaction from the log block start onwards,
+ * or with write unset only checks them. Returns the sequence number the
+ * next transaction should use.
+ */
+static unsigned long quickfs_journal_replay(struct super_block *sb, unsigned long start, unsigned long sequence,
+	int write)
+{
+
+	struct buffer_head **copies = QUICKFS_SB(sb)->journal.log;
+	unsigned long pos = start;
+	int replayed = 0;
+	int i;
+
+	while (pos + 2 <= NUM_JOURNAL_BLOCKS) {
+		struct buffer_head *desc_bh = sb_bread(sb, JOURNAL_LOG_TO_BLOCK_NUM(pos));
+		if (!desc_bh) break;
+
+		struct quickfs_journal_descriptor *desc = (struct quickfs_journal_descriptor *) desc_bh->b_data;
+		unsigned long count = desc->header.count;
+		if (desc->header.magic_number != JOURNAL_MAGIC_NUMBER ||
+			desc->header.type != JOURNAL_DESCRIPTOR_BLOCK ||
+			desc->header.sequence != sequence ||
+			count == 0 || count > JOURNAL_TAGS_PER_DESCRIPTOR ||
+			pos + count + 2 > NUM_JOURNAL_BLOCKS)
+		{
+			brelse(desc_bh);
 			break;
-			}
-		case 1: {
-			struct buffer_head *disk_sb_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
-			struct quickfs_sb *disk_sb = (struct quicks_sb *) disk_sb_bh->b_data;
+		}
 
-			struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
-			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
-			
-			if (disk_sb->data_blocks_free ==0) {
-				brelse(disk_sb_bh);
-				return -ENOSPC;
+		// Read every logged block, checksumming as we go
+		u32 checksum = crc32_le(~0, (unsigned char *) desc_bh->b_data, QUICKFS_BLOCK_SIZE);
+		int valid = 1;
+		for (i = 0; i < count; ++i) {
+			copies[i] = sb_bread(sb, JOURNAL_LOG_TO_BLOCK_NUM(pos + 1 + i));
+			if (!copies[i]) {
+				valid = 0;
+				break;
 			}
+			checksum = crc32_le(checksum, (unsigned char *) copies[i]->b_data, QUICKFS_BLOCK_SIZE);
+		}
+		int read = i;
+
+		if (valid) {
+			struct buffer_head *commit_bh = sb_bread(sb, JOURNAL_LOG_TO_BLOCK_NUM(pos + 1 + count));
+			struct quickfs_journal_commit *commit = commit_bh ?
+				(struct quickfs_journal_commit *) commit_bh->b_data : NULL;
+			valid = commit &&
+				commit->header.magic_number == JOURNAL_MAGIC_NUMBER &&
+				commit->header.type == JOURNAL_COMMIT_BLOCK &&
+				commit->header.sequence == sequence &&
+				commit->checksum == checksum;
+			brelse(commit_bh);
+		}
 
-			if (inode->i_size && block < disk_inode->data_block_count) {
-				short data_block = disk_inode->data_blocks[block];
-				map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_block));
-				return 0;
+		// Copy the logged blocks to their home locations
+		for (i = 0; i < read; ++i) {
+			unsigned long home = desc->block_nums[i];
+			if (valid && write && (home < FIRST_JOURNAL_BLOCK_NUM || home >= FIRST_JOURNAL_BLOCK_NUM + NUM_JOURNAL_BLOCKS)) {
+				struct buffer_head *home_bh = sb_getblk(sb, home);
+				lock_buffer(home_bh);
+				memcpy(home_bh->b_data, copies[i]->b_data, QUICKFS_BLOCK_SIZE);
+				set_buffer_uptodate(home_bh);
+				unlock_buffer(home_bh);
+				mark_buffer_dirty(home_bh);
+				brelse(home_bh);
 			}
+			brelse(copies[i]);
+		}
+		brelse(desc_bh);
 
-			int offset;
-			struct buffer_head *data_bitmap[NUM_DATA_BITMAP_BLOCKS];
-			for (offset = 0; offset < NUM_DATA_BITMAP_BLOCKS; ++offset) {
-				data_bitmap[offset] = sb_bread(sb, FIRST_DATA_BITMAP_BLOCK_NUM + offset);
-			}
+		if (!valid) break;
 
-			short first_free = first_free_bit(data_bitmap, NUM_DATA_BITMAP_BLOCKS);
-			offset = DATA_BIT_TO_DATA_BITMAP_BLOCK(first_free);
-			int index = DATA_BIT_TO_INDEX(first_free);
-			mark_bit(data_bitmap[offset], index);
+		pos += count + 2;
+		sequence++;
+		replayed++;
+	}
 
-			disk_inode->data_blocks[inode->i_blocks] = first_free;
-			disk_sb->data_blocks_free -= 1;
+	if (replayed && write) {
+		sync_blockdev(sb->s_bdev);
+		printk(KERN_INFO "quickfs: replayed %d journal transactions\n", replayed);
+	}
 
-			mark_buffer_dirty(disk_sb_bh);
-			mark_buffer_dirty(disk_inode_bh);
+	return sequence;
+}
 
-			map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(first_free));
-			inode->i_blocks += 1;
-			mark_inode_dirty(inode);
-			
-			brelse(disk_sb_bh);
-			brelse(disk_inode_bh);
-			for (offset = 0; offset < NUM_DATA_BITMAP_BLOCKS; ++offset) {
-				brelse(data_bitmap[offset]);
-			}
+static int quickfs_journal_load(struct super_block *sb) {
 
-			return 0;
-			break;
-			}
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
+
+	journal->sb = sb;
+	init_MUTEX(&journal->lock);
+	journal->count = 0;
+	journal->commit_scheduled = 0;
+	INIT_WORK(&journal->commit_work, quickfs_journal_commit_work, journal);
+
+	struct buffer_head *bh = sb_bread(sb, JOURNAL_SUPER_BLOCK_NUM);
+	if (!bh) {
+		return -EIO;
 	}
+	struct quickfs_journal_sb *jsb = (struct quickfs_journal_sb *) bh->b_data;
+	if (jsb->magic_number != JOURNAL_MAGIC_NUMBER) {
+		brelse(bh);
+		printk(KERN_ERR "quickfs: no journal found, reformat the image with mkquickfs\n");
+		return -EINVAL;
+	}
+	unsigned long sequence = jsb->sequence;
+	unsigned long start = jsb->start;
+	brelse(bh);
 
-	return -EIO;
-}
+	// A read-only mount leaves the device alone, so it can't replay the log
+	if (sb->s_flags & MS_RDONLY) {
+		if (start && quickfs_journal_replay(sb, start, sequence, 0) != sequence) {
+			printk(KERN_ERR "quickfs: the journal holds committed transactions, "
+				"mount read-write once to replay them\n");
+			return -EROFS;
+		}
+		journal->sequence = sequence;
+		journal->head = 1;
+		return 0;
+	}
 
-static int quickfs_readpage(struct file *file, struct page *page){
-	return block_read_full_page(page, quickfs_get_block);
+	if (start) {
+		sequence = quickfs_journal_replay(sb, start, sequence, 1);
+	}
+
+	// From now on the log is in use, starting from its first block
+	journal->sequence = sequence;
+	journal->head = 1;
+	return quickfs_write_journal_sb(sb, journal->sequence, journal->head);
 }
 
-static int quickfs_writepage(struct page *page, struct writeback_control *wbc){
-	return block_write_full_page(page, quickfs_get_block, wbc);
+static void quickfs_journal_release(struct super_block *sb) {
+
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
+
+	cancel_delayed_work(&journal->commit_work);
+	flush_scheduled_work();
+
+	// Commit whatever is left and mark the journal clean
+	down(&journal->lock);
+	quickfs_journal_commit(journal);
+	if (!(sb->s_flags & MS_RDONLY)) {
+		quickfs_write_journal_sb(sb, journal->sequence, 0);
+	}
+	up(&journal->lock);
 }
 
-static int quickfs_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to){
-	return block_prepare_write(page, from, to, quickfs_get_block);
+/*
+ * Marks the journal clean when the filesystem goes read-only, and in use
+ * again, from the front of the log, when it goes back to read-write
+ */
+static int quickfs_journal_remount(struct super_block *sb, int rdonly) {
+
+	struct quickfs_journal *journal = &QUICKFS_SB(sb)->journal;
+	int ret;
+
+	down(&journal->lock);
+	if (rdonly) {
+		quickfs_journal_commit(journal);
+		ret = quickfs_write_journal_sb(sb, journal->sequence, 0);
+	}
+	else {
+		journal->head = 1;
+		ret = quickfs_write_journal_sb(sb, journal->sequence, journal->head);
+	}
+	up(&journal->lock);
+	return ret;
 }
 
-static struct address_space_operations quickfs_addr_space_ops = {
-	.readpage = quickfs_readpage,
-	.writepage = quickfs_writepage,
-	.sync_page = block_sync_page,
-	.prepare_write = quickfs_prepare_write,
-	.commit_write = generic_commit_write
-};
+/*
+	Operation trace
 
-static struct file_operations quickfs_file_ops = {
-	.llseek = generic_file_llseek,
-	.read = generic_file_read,
-	.write = generic_file_write,
-	.mmap = generic_file_mmap,
-	.sendfile = generic_file_sendfile,
-	.fsync = file_fsync
-};
+	A fixed ring of records filled by the operations themselves and drained
+	through QUICKFS_IOC_READTRACE. When nobody drains it the newest records
+	are dropped rather than the oldest, so what is read back is always a
+	gapless prefix of the workload.
+*/
 
-static int quickfs_create(struct inode *inode, struct dentry *dentry, int mode, struct nameidata *nameidata) {
+static int quickfs_trace_init(struct super_block *sb) {
+
+	struct quickfs_trace *trace = kmalloc(sizeof(struct quickfs_trace), GFP_KERNEL);
+	if (!trace) {
+		return -ENOMEM;
+	}
+
+	trace->records = vmalloc(QUICKFS_TRACE_RECORDS * sizeof(struct quickfs_trace_record));
+	if (!trace->records) {
+		kfree(trace);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&trace->lock);
+	trace->head = trace->count = trace->dropped = 0;
+	QUICKFS_SB(sb)->trace = trace;
+	return 0;
+}
+
+static void quickfs_trace_release(struct super_block *sb) {
+
+	struct quickfs_trace *trace = QUICKFS_SB(sb)->trace;
+	if (trace) {
+		vfree(trace->records);
+		kfree(trace);
+		QUICKFS_SB(sb)->trace = NULL;
+	}
+}
+
+static void quickfs_trace(struct super_block *sb, int op, unsigned long ino, const struct qstr *name,
+	loff_t offset, size_t length)
+{
+	struct quickfs_trace *trace = QUICKFS_SB(sb)->trace;
+	if (!trace) {
+		return;
+	}
+
+	struct timeval now;
+	do_gettimeofday(&now);
+
+	spin_lock(&trace->lock);
+	if (trace->count == QUICKFS_TRACE_RECORDS) {
+		trace->dropped++;
+		spin_unlock(&trace->lock);
+		return;
+	}
+
+	struct quickfs_trace_record *record = &trace->records[(trace->head + trace->count) % QUICKFS_TRACE_RECORDS];
+	record->timestamp = (unsigned long long) now.tv_sec * 1000000 + now.tv_usec;
+	record->offset = offset;
+	record->length = length;
+	record->op = op;
+	record->ino = ino;
+	record->reserved = 0;
+	record->name[0] = '\0';
+	if (name) {
+		unsigned int len = min(name->len, (unsigned int) MAX_NAME_LENGTH - 1);
+		memcpy(record->name, name->name, len);
+		record->name[len] = '\0';
+	}
+	trace->count++;
+	spin_unlock(&trace->lock);
+}
+
+static int quickfs_read_trace(struct super_block *sb, struct quickfs_trace_buffer __user *arg) {
+
+	struct quickfs_trace *trace = QUICKFS_SB(sb)->trace;
+	struct quickfs_trace_buffer buffer;
+	struct quickfs_trace_record record;
+
+	if (!trace) {
+		return -EINVAL;
+	}
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	if (copy_from_user(&buffer, arg, sizeof(buffer))) {
+		return -EFAULT;
+	}
+
+	int copied;
+	for (copied = 0; copied < buffer.count; ++copied) {
+		spin_lock(&trace->lock);
+		if (!trace->count) {
+			spin_unlock(&trace->lock);
+			break;
+		}
+		record = trace->records[trace->head];
+		trace->head = (trace->head + 1) % QUICKFS_TRACE_RECORDS;
+		trace->count--;
+		spin_unlock(&trace->lock);
+
+		if (copy_to_user(buffer.records + copied, &record, sizeof(record))) {
+			return -EFAULT;
+		}
+	}
+
+	spin_lock(&trace->lock);
+	buffer.dropped = trace->dropped;
+	trace->dropped = 0;
+	spin_unlock(&trace->lock);
+
+	if (put_user(buffer.dropped, &arg->dropped)) {
+		return -EFAULT;
+	}
+	return copied;
+}
+
+/*
+	Inode writeback
+
+	With -o lazytime, writeback that doesn't have to wait skips inodes whose
+	only change since they were last written is their timestamps, and
+	keeps them on lazy_inodes instead. They are written when they leave the
+	inode cache, on fsync and sync, and once they have waited
+	QUICKFS_LAZYTIME_EXPIRE, in inode number order so the inode blocks go
+	out in ascending order.
+*/
+
+static kmem_cache_t *quickfs_inode_cachep;
+
+static struct inode *quickfs_alloc_inode(struct super_block *sb) {
+
+	struct quickfs_inode_info *info = kmem_cache_alloc(quickfs_inode_cachep, SLAB_KERNEL);
+	if (!info) {
+		return NULL;
+	}
+	INIT_LIST_HEAD(&info->lazy_list);
+	return &info->vfs_inode;
+}
+
+static void quickfs_destroy_inode(struct inode *inode) {
+	kmem_cache_free(quickfs_inode_cachep, QUICKFS_I(inode));
+}
+
+static void quickfs_init_once(void *object, kmem_cache_t *cachep, unsigned long flags) {
+
+	struct quickfs_inode_info *info = object;
+	if ((flags & (SLAB_CTOR_VERIFY | SLAB_CTOR_CONSTRUCTOR)) == SLAB_CTOR_CONSTRUCTOR) {
+		inode_init_once(&info->vfs_inode);
+	}
+}
+
+static int quickfs_init_inodecache(void) {
+
+	quickfs_inode_cachep = kmem_cache_create("quickfs_inode_cache", sizeof(struct quickfs_inode_info),
+		0, SLAB_RECLAIM_ACCOUNT, quickfs_init_once, NULL);
+	return quickfs_inode_cachep ? 0 : -ENOMEM;
+}
+
+static void quickfs_destroy_inodecache(void) {
+	kmem_cache_destroy(quickfs_inode_cachep);
+}
+
+// Records that the disk inode now matches the in-memory one
+static void quickfs_inode_synced(struct inode *inode) {
+
+	struct quickfs_sb_info *sb_info = QUICKFS_SB(inode->i_sb);
+	struct quickfs_inode_info *info = QUICKFS_I(inode);
+
+	info->disk_size = inode->i_size;
+	info->disk_mode = inode->i_mode;
+	info->disk_uid = inode->i_uid;
+	info->disk_gid = inode->i_gid;
+	info->disk_nlink = inode->i_nlink;
+
+	spin_lock(&sb_info->lazy_lock);
+	int lazy = !list_empty(&info->lazy_list);
+	list_del_init(&info->lazy_list);
+	spin_unlock(&sb_info->lazy_lock);
+
+	if (lazy) {
+		iput(inode);
+	}
+}
+
+static int quickfs_write_disk_inode(struct inode *inode) {
+
+	unsigned long inode_num = inode->i_ino;
+	if (inode_num < ROOT_INODE_NUM || inode_num > 4095) {
+		return -EIO;
+	}
+
+	quickfs_journal_start(inode->i_sb);
+
+	struct buffer_head *bh = sb_bread(inode->i_sb, INODE_NUM_TO_BLOCK_NUM(inode_num));
+	if (!bh) {
+		quickfs_journal_stop(inode->i_sb);
+		return -EIO;
+	}
+
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) bh->b_data;
+
+	disk_inode->umode = inode->i_mode;
+	disk_inode->uid = inode->i_uid;
+	disk_inode->gid = inode->i_gid;
+	disk_inode->size = inode->i_size;
+	disk_inode->hard_links = inode->i_nlink;
+	disk_inode->atime = inode->i_atime;
+	disk_inode->mtime = inode->i_mtime;
+	disk_inode->ctime = inode->i_ctime;
+	
+	quickfs_journal_dirty(inode->i_sb, bh);
+	brelse(bh);
+	quickfs_journal_stop(inode->i_sb);
+
+	quickfs_inode_synced(inode);
+	return 0;
+}
+
+/*
+ * Returns 1 if the inode's change can wait on lazy_inodes. The list keeps a
+ * reference to the inode, so it stays cached until its timestamps are
+ * written and eviction, which can come from memory reclaim while the journal
+ * is held, never has to write them.
+ */
+static int quickfs_hold_timestamps(struct inode *inode) {
+
+	struct quickfs_sb_info *sb_info = QUICKFS_SB(inode->i_sb);
+	struct quickfs_inode_info *info = QUICKFS_I(inode);
+
+	if (!sb_info->lazytime || !inode->i_nlink ||
+		inode->i_size != info->disk_size || inode->i_mode != info->disk_mode ||
+		inode->i_uid != info->disk_uid || inode->i_gid != info->disk_gid ||
+		inode->i_nlink != info->disk_nlink)
+	{
+		return 0;
+	}
+
+	spin_lock(&sb_info->lazy_lock);
+	if (list_empty(&info->lazy_list)) {
+		if (!igrab(inode)) {
+			spin_unlock(&sb_info->lazy_lock);
+			return 0;
+		}
+		info->lazy_since = jiffies;
+		list_add_tail(&info->lazy_list, &sb_info->lazy_inodes);
+	}
+	if (!sb_info->lazy_scheduled) {
+		sb_info->lazy_scheduled = 1;
+		schedule_delayed_work(&sb_info->lazy_work, QUICKFS_LAZYTIME_EXPIRE);
+	}
+	spin_unlock(&sb_info->lazy_lock);
+	return 1;
+}
+
+static int quickfs_write_inode(struct inode *inode, int wait) {
+
+	if (!wait && quickfs_hold_timestamps(inode)) {
+		return 0;
+	}
+	return quickfs_write_disk_inode(inode);
+}
+
+// Writes an inode's held-back timestamps, if it has any
+static void quickfs_flush_lazy_inode(struct inode *inode) {
+
+	struct quickfs_sb_info *sb_info = QUICKFS_SB(inode->i_sb);
+
+	spin_lock(&sb_info->lazy_lock);
+	int lazy = !list_empty(&QUICKFS_I(inode)->lazy_list);
+	spin_unlock(&sb_info->lazy_lock);
+
+	if (lazy) {
+		quickfs_write_disk_inode(inode);
+	}
+}
+
+/*
+ * Writes every lazy inode that has waited at least min_age, a batch at a
+ * time, and drops the list's reference to it
+ */
+static void quickfs_flush_lazy_inodes(struct super_block *sb, unsigned long min_age) {
+
+	struct quickfs_sb_info *sb_info = QUICKFS_SB(sb);
+	struct inode *batch[QUICKFS_LAZYTIME_BATCH];
+	int count, more;
+
+	do {
+		struct list_head *pos, *next;
+		count = more = 0;
+
+		spin_lock(&sb_info->lazy_lock);
+		list_for_each_safe(pos, next, &sb_info->lazy_inodes) {
+			struct quickfs_inode_info *info = list_entry(pos, struct quickfs_inode_info, lazy_list);
+			if (time_before(jiffies, info->lazy_since + min_age)) continue;
+			if (count == QUICKFS_LAZYTIME_BATCH) {
+				more = 1;
+				break;
+			}
+			list_del_init(pos);
+			batch[count++] = &info->vfs_inode;
+		}
+		spin_unlock(&sb_info->lazy_lock);
+
+		// Insertion sort by inode number, which is also inode block order
+		int i, j;
+		for (i = 1; i < count; ++i) {
+			struct inode *inode = batch[i];
+			for (j = i; j > 0 && batch[j - 1]->i_ino > inode->i_ino; --j) {
+				batch[j] = batch[j - 1];
+			}
+			batch[j] = inode;
+		}
+
+		for (i = 0; i < count; ++i) {
+			quickfs_write_disk_inode(batch[i]);
+			iput(batch[i]);
+		}
+	} while (more);
+}
+
+static void quickfs_lazytime_work(void *data) {
+
+	struct super_block *sb = data;
+	struct quickfs_sb_info *sb_info = QUICKFS_SB(sb);
+
+	quickfs_flush_lazy_inodes(sb, QUICKFS_LAZYTIME_EXPIRE);
+
+	spin_lock(&sb_info->lazy_lock);
+	if (list_empty(&sb_info->lazy_inodes)) {
+		sb_info->lazy_scheduled = 0;
+	}
+	else {
+		schedule_delayed_work(&sb_info->lazy_work, QUICKFS_LAZYTIME_EXPIRE);
+	}
+	spin_unlock(&sb_info->lazy_lock);
+}
+
+/*
+ * Drops one of the extra references to a data block, returning 0 without
+ * doing anything if the block isn't shared. *refcount_bh caches the last
+ * refcount block used between calls and must be released by the caller.
+ * Must be called inside a journal handle.
+ */
+static int quickfs_put_shared_block(struct super_block *sb, int data_block, struct buffer_head **refcount_bh) {
+
+	unsigned long block_num = DATA_BIT_TO_REFCOUNT_BLOCK(data_block);
+	if (!*refcount_bh || (*refcount_bh)->b_blocknr != block_num) {
+		brelse(*refcount_bh);
+		*refcount_bh = sb_bread(sb, block_num);
+		if (!*refcount_bh) {
+			return 0;
+		}
+	}
+
+	unsigned char *refcount = (unsigned char *) (*refcount_bh)->b_data + DATA_BIT_TO_REFCOUNT_INDEX(data_block);
+	if (!*refcount) {
+		return 0;
+	}
+
+	if (--*refcount == 0) {
+		QUICKFS_SB(sb)->shared_blocks--;
+	}
+	quickfs_journal_dirty(sb, *refcount_bh);
+	return 1;
+}
+
+/*
+ * Frees a batch of data blocks, reading each bitmap block and the
+ * superblock once no matter how many blocks are freed. Shared blocks
+ * only lose a reference. Must be called inside a journal handle.
+ */
+static void quickfs_free_data_blocks(struct super_block *sb, unsigned short *data_blocks, int count) {
+
+	if (count <= 0) {
+		return;
+	}
+
+	struct buffer_head *data_bitmap[NUM_DATA_BITMAP_BLOCKS];
+	int block;
+	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
+		data_bitmap[block] = sb_bread(sb, FIRST_DATA_BITMAP_BLOCK_NUM + block);
+	}
+
+	struct buffer_head *refcount_bh = NULL;
+	int freed = 0;
+	int i;
+	for (i = 0; i < count; ++i) {
+		if (data_blocks[i] == DATA_BLOCK_HOLE) continue;
+		int data_block = DATA_BLOCK_BIT(data_blocks[i]);
+		if (QUICKFS_SB(sb)->shared_blocks && quickfs_put_shared_block(sb, data_block, &refcount_bh)) continue;
+		freed++;
+		int block = DATA_BIT_TO_DATA_BITMAP_BLOCK(data_block);
+		int index = DATA_BIT_TO_INDEX(data_block);
+		clear_bitmap_bit(data_bitmap[block], index);
+		quickfs_journal_dirty(sb, data_bitmap[block]);
+	}
+	
+	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
+		brelse(data_bitmap[block]);
+	}
+	brelse(refcount_bh);
+
+	struct buffer_head *super_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+	struct quickfs_sb *disk_sb = (struct quickfs_sb *) super_bh->b_data;
+	disk_sb->data_blocks_free += freed;
+	quickfs_journal_dirty(sb, super_bh);
+	brelse(super_bh);
+}
+
+/*
+ * Allocates count data blocks into data_blocks, taking them from one
+ * contiguous run when there is one and from the lowest free blocks
+ * otherwise. Must be called inside a journal handle.
+ */
+static int quickfs_alloc_data_blocks(struct super_block *sb, unsigned short *data_blocks, int count) {
+
+	if (count <= 0) {
+		return 0;
+	}
+
+	struct buffer_head *super_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+	struct quickfs_sb *disk_sb = (struct quickfs_sb *) super_bh->b_data;
+	if (count > disk_sb->data_blocks_free) {
+		brelse(super_bh);
+		return -ENOSPC;
+	}
+
+	struct buffer_head *data_bitmap[NUM_DATA_BITMAP_BLOCKS];
+	int block;
+	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
+		data_bitmap[block] = sb_bread(sb, FIRST_DATA_BITMAP_BLOCK_NUM + block);
+	}
+
+	int run_start = first_free_run(data_bitmap, NUM_DATA_BITMAP_BLOCKS, count);
+	int i;
+	for (i = 0; i < count; ++i) {
+		int data_block = run_start >= 0 ? run_start + i : first_free_bit(data_bitmap, NUM_DATA_BITMAP_BLOCKS);
+		block = DATA_BIT_TO_DATA_BITMAP_BLOCK(data_block);
+		mark_bit(data_bitmap[block], DATA_BIT_TO_INDEX(data_block));
+		quickfs_journal_dirty(sb, data_bitmap[block]);
+		data_blocks[i] = data_block;
+	}
+
+	for (block = 0; block < NUM_DATA_BITMAP_BLOCKS; ++block) {
+		brelse(data_bitmap[block]);
+	}
+
+	disk_sb->data_blocks_free -= count;
+	quickfs_journal_dirty(sb, super_bh);
+	brelse(super_bh);
+	return 0;
+}
+
+/*
+	Shared data blocks
+
+	Nothing in the kernel creates sharing; dedupquickfs does, offline. The
+	kernel only has to keep writes from reaching a block another file still
+	reads, so every write path copies a shared block first. shared_blocks
+	lets filesystems without any sharing skip the refcount lookups.
+*/
+
+static unsigned long quickfs_count_shared_blocks(struct super_block *sb) {
+
+	unsigned long shared = 0;
+	int block;
+	for (block = 0; block < NUM_REFCOUNT_BLOCKS; ++block) {
+		struct buffer_head *bh = sb_bread(sb, FIRST_REFCOUNT_BLOCK_NUM + block);
+		if (!bh) continue;
+		int i;
+		for (i = 0; i < QUICKFS_BLOCK_SIZE; ++i) {
+			if (bh->b_data[i]) shared++;
+		}
+		brelse(bh);
+	}
+	return shared;
+}
+
+static int quickfs_block_shared(struct super_block *sb, int data_block) {
+
+	if (!QUICKFS_SB(sb)->shared_blocks) {
+		return 0;
+	}
+
+	struct buffer_head *bh = sb_bread(sb, DATA_BIT_TO_REFCOUNT_BLOCK(data_block));
+	if (!bh) {
+		return 0;
+	}
+	int shared = bh->b_data[DATA_BIT_TO_REFCOUNT_INDEX(data_block)] != 0;
+	brelse(bh);
+	return shared;
+}
+
+/*
+ * Gives entry index of an inode a private copy of its data block, if that
+ * block is shared. The copy is on disk before the inode points at it, so a
+ * buffer mapped to the new block can be read from the device. Returns 1 if
+ * the block was copied. Must be called inside a journal handle.
+ */
+static int quickfs_unshare_block(struct super_block *sb, struct buffer_head *disk_inode_bh, int index) {
+
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+	unsigned short entry = disk_inode->data_blocks[index];
+
+	if (entry == DATA_BLOCK_HOLE || (entry & DATA_BLOCK_UNWRITTEN) || !quickfs_block_shared(sb, entry)) {
+		return 0;
+	}
+
+	unsigned short copy;
+	int ret = quickfs_alloc_data_blocks(sb, &copy, 1);
+	if (ret) {
+		return ret;
+	}
+
+	struct buffer_head *old_bh = sb_bread(sb, DATA_BIT_NUM_TO_BLOCK_NUM(entry));
+	if (!old_bh) {
+		quickfs_free_data_blocks(sb, &copy, 1);
+		return -EIO;
+	}
+	struct buffer_head *new_bh = sb_getblk(sb, DATA_BIT_NUM_TO_BLOCK_NUM(copy));
+	lock_buffer(new_bh);
+	memcpy(new_bh->b_data, old_bh->b_data, QUICKFS_BLOCK_SIZE);
+	set_buffer_uptodate(new_bh);
+	unlock_buffer(new_bh);
+	mark_buffer_dirty(new_bh);
+	sync_dirty_buffer(new_bh);
+	brelse(new_bh);
+	brelse(old_bh);
+
+	struct buffer_head *refcount_bh = NULL;
+	quickfs_put_shared_block(sb, entry, &refcount_bh);
+	brelse(refcount_bh);
+
+	disk_inode->data_blocks[index] = copy;
+	quickfs_journal_dirty(sb, disk_inode_bh);
+	return 1;
+}
+
+/*
+ * Unmaps the buffers of a page that point at shared blocks, so that
+ * block_prepare_write and block_write_full_page ask get_block for them
+ * again and get a private copy
+ */
+static void quickfs_unmap_shared_buffers(struct page *page) {
+
+	struct super_block *sb = page->mapping->host->i_sb;
+	if (!QUICKFS_SB(sb)->shared_blocks || !page_has_buffers(page)) {
+		return;
+	}
+
+	struct buffer_head *head = page_buffers(page);
+	struct buffer_head *bh = head;
+	do {
+		if (buffer_mapped(bh) && bh->b_blocknr >= FIRST_DATA_BLOCK_NUM &&
+			quickfs_block_shared(sb, bh->b_blocknr - FIRST_DATA_BLOCK_NUM))
+		{
+			clear_buffer_mapped(bh);
+		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+
+/*
+	Name table
+
+	Create and link add an entry for the new name and unlink removes it,
+	each inside the caller's journal handle. A removed entry becomes a
+	tombstone so probes for names past it keep going, unless nothing
+	follows it in the block, in which case it and any tombstones before
+	it are emptied.
+*/
+
+static struct quickfs_name_entry *quickfs_name_entry(struct super_block *sb, unsigned long slot,
+	struct buffer_head **bh)
+{
+	unsigned long block = FIRST_NAME_TABLE_BLOCK_NUM + slot / NAME_ENTRIES_PER_BLOCK;
+	if (!*bh || (*bh)->b_blocknr != block) {
+		brelse(*bh);
+		*bh = sb_bread(sb, block);
+		if (!*bh) {
+			return NULL;
+		}
+	}
+	return (struct quickfs_name_entry *) (*bh)->b_data + slot % NAME_ENTRIES_PER_BLOCK;
+}
+
+/*
+ * Returns the number of the disk inode holding name, or -ENOENT. When link
+ * is nonzero, only a hard link record pointing at inode link matches. The
+ * slot of the entry goes to *slot and the record's link field to *target,
+ * when they aren't NULL.
+ */
+static int quickfs_name_find(struct super_block *sb, const struct qstr *name, int link,
+	unsigned long *slot, int *target)
+{
+	unsigned int hash = quickfs_name_hash(name->name, name->len);
+	unsigned long probe = hash % NAME_TABLE_SLOTS;
+	struct buffer_head *bh = NULL;
+	int ret = -ENOENT;
+
+	unsigned long probes;
+	for (probes = 0; probes < NAME_TABLE_SLOTS; ++probes, probe = (probe + 1) % NAME_TABLE_SLOTS) {
+		struct quickfs_name_entry *entry = quickfs_name_entry(sb, probe, &bh);
+		if (!entry) {
+			ret = -EIO;
+			break;
+		}
+		if (entry->ino == NAME_TABLE_EMPTY) break;
+		if (entry->ino == NAME_TABLE_DELETED || entry->hash != hash) continue;
+
+		struct buffer_head *inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(entry->ino));
+		if (!inode_bh) {
+			ret = -EIO;
+			break;
+		}
+		struct quickfs_inode *disk_inode = (struct quickfs_inode *) inode_bh->b_data;
+		int match = strnlen(disk_inode->name, MAX_NAME_LENGTH) == name->len &&
+			!memcmp(disk_inode->name, name->name, name->len) &&
+			(!link || disk_inode->link == link);
+		int record_link = disk_inode->link;
+		brelse(inode_bh);
+
+		if (match) {
+			if (slot) *slot = probe;
+			if (target) *target = record_link;
+			ret = entry->ino;
+			break;
+		}
+	}
+
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Adds an entry mapping name to disk inode ino and returns its slot.
+ * Must be called inside a journal handle.
+ */
+static long quickfs_name_insert(struct super_block *sb, const struct qstr *name, int ino) {
+
+	unsigned int hash = quickfs_name_hash(name->name, name->len);
+	unsigned long probe = hash % NAME_TABLE_SLOTS;
+	struct buffer_head *bh = NULL;
+	long ret = -ENOSPC;
+
+	unsigned long probes;
+	for (probes = 0; probes < NAME_TABLE_SLOTS; ++probes, probe = (probe + 1) % NAME_TABLE_SLOTS) {
+		struct quickfs_name_entry *entry = quickfs_name_entry(sb, probe, &bh);
+		if (!entry) {
+			ret = -EIO;
+			break;
+		}
+		if (entry->ino == NAME_TABLE_EMPTY || entry->ino == NAME_TABLE_DELETED) {
+			entry->hash = hash;
+			entry->ino = ino;
+			quickfs_journal_dirty(sb, bh);
+			ret = probe;
+			break;
+		}
+	}
+
+	brelse(bh);
+	return ret;
+}
+
+// Must be called inside a journal handle
+static void quickfs_name_remove(struct super_block *sb, unsigned long slot) {
+
+	struct buffer_head *bh = NULL;
+	struct quickfs_name_entry *entry = quickfs_name_entry(sb, slot, &bh);
+	if (!entry) {
+		return;
+	}
+
+	struct quickfs_name_entry *entries = (struct quickfs_name_entry *) bh->b_data;
+	int index = slot % NAME_ENTRIES_PER_BLOCK;
+	entry->ino = NAME_TABLE_DELETED;
+	if (index + 1 < NAME_ENTRIES_PER_BLOCK && entries[index + 1].ino == NAME_TABLE_EMPTY) {
+		while (index >= 0 && entries[index].ino == NAME_TABLE_DELETED) {
+			entries[index--].ino = NAME_TABLE_EMPTY;
+		}
+	}
+
+	quickfs_journal_dirty(sb, bh);
+	brelse(bh);
+}
+
+static void quickfs_delete_inode(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	quickfs_journal_start(sb);
+
+	struct buffer_head *inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) inode_bh->b_data;
+	quickfs_free_data_blocks(sb, disk_inode->data_blocks, disk_inode->data_block_count);
+	brelse(inode_bh);
+
+	struct buffer_head *inode_bitmap_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
+	clear_bitmap_bit(inode_bitmap_bh, inode->i_ino);
+	quickfs_journal_dirty(sb, inode_bitmap_bh);
+	brelse(inode_bitmap_bh);
+
+	struct buffer_head *super_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+	struct quickfs_sb *disk_sb = (struct quickfs_sb *) super_bh->b_data;
+	disk_sb->inodes_free += 1;
+	quickfs_journal_dirty(sb, super_bh);
+	brelse(super_bh);
+
+	quickfs_journal_stop(sb);
+	clear_inode(inode);
+}
+
+
+static int quickfs_readdir(struct file *file, void *dirent, filldir_t filldir) {
+
+     struct inode * dir = file->f_dentry->d_inode;
+     struct dentry * de;
+ 
+     if (file->f_pos) {
+         return 1;
+     }
+
+	de = file->f_dentry;
 	
+	if (filldir(dirent, ".", 1, file->f_pos++, 4096, DT_REG)) return 1;
+	if (filldir(dirent, "..", 2, file->f_pos++, 4097, DT_REG)) {
+		return 1;
+	}
+
+	int ino = 1;
+	struct buffer_head *inode_bitmap_bh = sb_bread(dir->i_sb, INODE_BITMAP_BLOCK_NUM);
+	do {
+		if (test_for_bit(inode_bitmap_bh, ino)){
+			struct buffer_head *disk_inode_bh = sb_bread(dir->i_sb, INODE_NUM_TO_BLOCK_NUM(ino));	
+			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+			int j;
+
+			char *name  = disk_inode->name;
+			int size = strnlen(name, MAX_NAME_LENGTH);
+			if (strcmp(name, "") == 0) {
+				brelse(disk_inode_bh);
+				ino++;
+				continue;
+			}
+			int corresponding_ino = ino;
+			if (disk_inode->link > 0) {
+				corresponding_ino = disk_inode->link;
+			}
+			if (filldir(dirent, name, size, file->f_pos++, corresponding_ino, DT_REG) < 0){
+				brelse(disk_inode_bh);
+				return 0;
+			}
+			brelse(disk_inode_bh);
+		}
+		ino++;
+		
+	} while (ino < 8*QUICKFS_BLOCK_SIZE);
+	brelse(inode_bitmap_bh);
+	return 1;  
+}
+
+
+static struct inode_operations quickfs_inode_ops = {
+	.create = quickfs_create,
+	.lookup = quickfs_lookup, 
+	.link = quickfs_link,
+	.unlink = quickfs_unlink,
+	.truncate = quickfs_truncate
+};
+
+static int quickfs_get_block(struct inode * inode, sector_t block, struct buffer_head * bh_result, int create){
+
+	struct super_block *sb = inode->i_sb;
+
+	switch(create) {
+		case 0: {
+			struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+			
+			// Holes, blocks past the end of the map and preallocated-but-unwritten blocks read as zeros
+			if (block >= disk_inode->data_block_count ||
+				disk_inode->data_blocks[block] == DATA_BLOCK_HOLE ||
+				(disk_inode->data_blocks[block] & DATA_BLOCK_UNWRITTEN))
+			{
+				brelse(disk_inode_bh);
+				return 0;
+			}
+
+			short data_block = disk_inode->data_blocks[block];
+			map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_block));
+
+			brelse(disk_inode_bh);
+			return 0;
+			break;
+			}
+		case 1: {
+			if (block >= MAX_DATA_BLOCKS_PER_INODE) {
+				return -EFBIG;
+			}
+
+			/*
+			 * Overwriting a block that is already mapped, written and not
+			 * shared changes no metadata, so it doesn't need the journal
+			 */
+			struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+			if (!disk_inode_bh) {
+				return -EIO;
+			}
+			struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+			if (block < disk_inode->data_block_count) {
+				unsigned short entry = disk_inode->data_blocks[block];
+				if (entry != DATA_BLOCK_HOLE && !(entry & DATA_BLOCK_UNWRITTEN) && !quickfs_block_shared(sb, entry)) {
+					map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(entry));
+					brelse(disk_inode_bh);
+					return 0;
+				}
+			}
+
+			quickfs_journal_start(sb);
+
+			struct buffer_head *disk_sb_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+			struct quickfs_sb *disk_sb = (struct quickfs_sb *) disk_sb_bh->b_data;
+			
+			if (block < disk_inode->data_block_count && disk_inode->data_blocks[block] != DATA_BLOCK_HOLE) {
+				int ret = quickfs_unshare_block(sb, disk_inode_bh, block);
+				if (ret < 0) {
+					brelse(disk_sb_bh);
+					brelse(disk_inode_bh);
+					quickfs_journal_stop(sb);
+					return ret;
+				}
+
+				unsigned short data_block = disk_inode->data_blocks[block];
+
+				/*
+				 * First write to a preallocated block. Whatever is on disk
+				 * there is stale, so have the caller zero the parts of the
+				 * block it isn't about to write.
+				 */
+				if (data_block & DATA_BLOCK_UNWRITTEN) {
+					data_block = DATA_BLOCK_BIT(data_block);
+					disk_inode->data_blocks[block] = data_block;
+					quickfs_journal_dirty(sb, disk_inode_bh);
+					set_buffer_new(bh_result);
+				}
+
+				map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_block));
+				brelse(disk_sb_bh);
+				brelse(disk_inode_bh);
+				quickfs_journal_stop(sb);
+				return 0;
+			}
+
+			if (disk_sb->data_blocks_free ==0) {
+				brelse(disk_sb_bh);
+				brelse(disk_inode_bh);
+				quickfs_journal_stop(sb);
+				return -ENOSPC;
+			}
+
+			int offset;
+			struct buffer_head *data_bitmap[NUM_DATA_BITMAP_BLOCKS];
+			for (offset = 0; offset < NUM_DATA_BITMAP_BLOCKS; ++offset) {
+				data_bitmap[offset] = sb_bread(sb, FIRST_DATA_BITMAP_BLOCK_NUM + offset);
+			}
+
+			short first_free = first_free_bit(data_bitmap, NUM_DATA_BITMAP_BLOCKS);
+			offset = DATA_BIT_TO_DATA_BITMAP_BLOCK(first_free);
+			int index = DATA_BIT_TO_INDEX(first_free);
+			mark_bit(data_bitmap[offset], index);
+
+			// Entries between the old end of the map and this block stay holes
+			while (disk_inode->data_block_count < block) {
+				disk_inode->data_blocks[disk_inode->data_block_count++] = DATA_BLOCK_HOLE;
+			}
+			disk_inode->data_blocks[block] = first_free;
+			if (block == disk_inode->data_block_count) {
+				disk_inode->data_block_count++;
+			}
+			disk_sb->data_blocks_free -= 1;
+
+			quickfs_journal_dirty(sb, data_bitmap[offset]);
+			quickfs_journal_dirty(sb, disk_sb_bh);
+			quickfs_journal_dirty(sb, disk_inode_bh);
+
+			map_bh(bh_result, sb, DATA_BIT_NUM_TO_BLOCK_NUM(first_free));
+			set_buffer_new(bh_result);
+			inode->i_blocks += 1;
+			
+			brelse(disk_sb_bh);
+			brelse(disk_inode_bh);
+			for (offset = 0; offset < NUM_DATA_BITMAP_BLOCKS; ++offset) {
+				brelse(data_bitmap[offset]);
+			}
+
+			quickfs_journal_stop(sb);
+			return 0;
+			break;
+			}
+	}
+
+	return -EIO;
+}
+
+/*
+	Compressed files
+
+	A file with QUICKFS_COMPRESS_FL set is stored as a series of
+	QUICKFS_CLUSTER_SIZE clusters, one per page. Cluster c owns entries
+	c * QUICKFS_CLUSTER_BLOCKS through (c + 1) * QUICKFS_CLUSTER_BLOCKS - 1
+	of data_blocks. A cluster that deflates to fewer blocks than that is
+	stored compressed in the leading entries, with the rest set to
+	DATA_BLOCK_HOLE. A cluster that doesn't is stored raw in all of its
+	entries. Cluster data goes through the buffer cache of the device
+	rather than get_block, and is (de)compressed a page at a time in
+	readpage and writepage.
+*/
+
+static DECLARE_MUTEX(quickfs_zlib_lock);
+static z_stream quickfs_deflate_stream;
+static z_stream quickfs_inflate_stream;
+static unsigned char *quickfs_cluster_buffer;
+
+static int quickfs_zlib_init(void) {
+
+	quickfs_deflate_stream.workspace = vmalloc(zlib_deflate_workspacesize());
+	quickfs_inflate_stream.workspace = vmalloc(zlib_inflate_workspacesize());
+	quickfs_cluster_buffer = kmalloc(QUICKFS_CLUSTER_SIZE, GFP_KERNEL);
+
+	if (!quickfs_deflate_stream.workspace || !quickfs_inflate_stream.workspace || !quickfs_cluster_buffer) {
+		vfree(quickfs_deflate_stream.workspace);
+		vfree(quickfs_inflate_stream.workspace);
+		kfree(quickfs_cluster_buffer);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void quickfs_zlib_exit(void) {
+
+	vfree(quickfs_deflate_stream.workspace);
+	vfree(quickfs_inflate_stream.workspace);
+	kfree(quickfs_cluster_buffer);
+}
+
+/*
+ * Returns the compressed length, or 0 if the cluster doesn't fit in max bytes
+ */
+static int quickfs_compress_cluster(const void *cluster, void *compressed, int max) {
+
+	z_stream *stream = &quickfs_deflate_stream;
+	if (zlib_deflateInit(stream, Z_BEST_SPEED) != Z_OK) {
+		return 0;
+	}
+
+	stream->next_in = (unsigned char *) cluster;
+	stream->avail_in = QUICKFS_CLUSTER_SIZE;
+	stream->next_out = (unsigned char *) compressed;
+	stream->avail_out = max;
+
+	int ret = zlib_deflate(stream, Z_FINISH);
+	int length = stream->total_out;
+	zlib_deflateEnd(stream);
+
+	return ret == Z_STREAM_END ? length : 0;
+}
+
+static int quickfs_decompress_cluster(const void *compressed, int length, void *cluster) {
+
+	z_stream *stream = &quickfs_inflate_stream;
+	if (zlib_inflateInit(stream) != Z_OK) {
+		return -EIO;
+	}
+
+	stream->next_in = (unsigned char *) compressed;
+	stream->avail_in = length;
+	stream->next_out = (unsigned char *) cluster;
+	stream->avail_out = QUICKFS_CLUSTER_SIZE;
+
+	int ret = zlib_inflate(stream, Z_FINISH);
+	int decompressed = stream->total_out;
+	zlib_inflateEnd(stream);
+
+	if (ret != Z_STREAM_END) {
+		return -EIO;
+	}
+	memset((char *) cluster + decompressed, 0, QUICKFS_CLUSTER_SIZE - decompressed);
+	return 0;
+}
+
+static int quickfs_cluster_block_count(struct quickfs_inode *disk_inode, unsigned long cluster) {
+
+	int first = cluster * QUICKFS_CLUSTER_BLOCKS;
+	int count = 0;
+	while (count < QUICKFS_CLUSTER_BLOCKS && first + count < disk_inode->data_block_count &&
+		disk_inode->data_blocks[first + count] != DATA_BLOCK_HOLE)
+	{
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Fills data with QUICKFS_CLUSTER_SIZE bytes of the given cluster
+ */
+static int quickfs_read_cluster(struct inode *inode, unsigned long cluster, void *data) {
+
+	struct super_block *sb = inode->i_sb;
+	unsigned short data_blocks[QUICKFS_CLUSTER_BLOCKS];
+	int ret = 0;
+	int i;
+
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	if (!disk_inode_bh) {
+		return -EIO;
+	}
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+	int count = quickfs_cluster_block_count(disk_inode, cluster);
+	memcpy(data_blocks, disk_inode->data_blocks + cluster * QUICKFS_CLUSTER_BLOCKS, count * sizeof(unsigned short));
+	brelse(disk_inode_bh);
+
+	// Clusters that were never written read as zeros
+	if (!count) {
+		memset(data, 0, QUICKFS_CLUSTER_SIZE);
+		return 0;
+	}
+
+	// Raw clusters are read straight into the page
+	unsigned char *dest = count == QUICKFS_CLUSTER_BLOCKS ? (unsigned char *) data : NULL;
+
+	down(&quickfs_zlib_lock);
+	if (!dest) dest = quickfs_cluster_buffer;
+
+	for (i = 0; i < count; ++i) {
+		struct buffer_head *bh = sb_bread(sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_blocks[i]));
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		memcpy(dest + i * QUICKFS_BLOCK_SIZE, bh->b_data, QUICKFS_BLOCK_SIZE);
+		brelse(bh);
+	}
+
+	if (dest == quickfs_cluster_buffer) {
+		ret = quickfs_decompress_cluster(quickfs_cluster_buffer, count * QUICKFS_BLOCK_SIZE, data);
+	}
+
+out:
+	up(&quickfs_zlib_lock);
+	return ret;
+}
+
+/*
+ * Stores QUICKFS_CLUSTER_SIZE bytes of data as the given cluster, compressed
+ * if that saves at least one block
+ */
+static int quickfs_write_cluster(struct inode *inode, unsigned long cluster, void *data) {
+
+	struct super_block *sb = inode->i_sb;
+	int first = cluster * QUICKFS_CLUSTER_BLOCKS;
+	int ret = 0;
+	int i;
+
+	down(&quickfs_zlib_lock);
+
+	unsigned char *source = quickfs_cluster_buffer;
+	int length = quickfs_compress_cluster(data, quickfs_cluster_buffer,
+		QUICKFS_CLUSTER_SIZE - QUICKFS_BLOCK_SIZE);
+	if (!length) {
+		source = (unsigned char *) data;
+		length = QUICKFS_CLUSTER_SIZE;
+	}
+	int count = (length + QUICKFS_BLOCK_SIZE - 1) >> QUICKFS_BLOCK_SIZE_BITS;
+
+	quickfs_journal_start(sb);
+
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+
+	int old_count = quickfs_cluster_block_count(disk_inode, cluster);
+	unsigned short *data_blocks = disk_inode->data_blocks + first;
+
+	/*
+	 * Reuse the cluster's blocks if it still fits in them. Otherwise take a
+	 * fresh run, so the cluster stays contiguous, and only give the old
+	 * blocks back once that worked, so a failed allocation leaves the
+	 * cluster as it was on disk.
+	 */
+	if (count <= old_count) {
+		quickfs_free_data_blocks(sb, data_blocks + count, old_count - count);
+	}
+	else {
+		unsigned short new_blocks[QUICKFS_CLUSTER_BLOCKS];
+		ret = quickfs_alloc_data_blocks(sb, new_blocks, count);
+		if (ret) {
+			goto out;
+		}
+		quickfs_free_data_blocks(sb, data_blocks, old_count);
+		memcpy(data_blocks, new_blocks, count * sizeof(unsigned short));
+	}
+
+	// Clusters past the end of the map become holes until written
+	while (disk_inode->data_block_count < first) {
+		disk_inode->data_blocks[disk_inode->data_block_count++] = DATA_BLOCK_HOLE;
+	}
+	for (i = count; i < QUICKFS_CLUSTER_BLOCKS; ++i) {
+		data_blocks[i] = DATA_BLOCK_HOLE;
+	}
+	if (disk_inode->data_block_count < first + QUICKFS_CLUSTER_BLOCKS) {
+		disk_inode->data_block_count = first + QUICKFS_CLUSTER_BLOCKS;
+	}
+	inode->i_blocks += count - old_count;
+	quickfs_journal_dirty(sb, disk_inode_bh);
+
+	for (i = 0; i < count; ++i) {
+		struct buffer_head *bh = sb_getblk(sb, DATA_BIT_NUM_TO_BLOCK_NUM(data_blocks[i]));
+		int chunk = min(length - i * QUICKFS_BLOCK_SIZE, QUICKFS_BLOCK_SIZE);
+		lock_buffer(bh);
+		memcpy(bh->b_data, source + i * QUICKFS_BLOCK_SIZE, chunk);
+		memset(bh->b_data + chunk, 0, QUICKFS_BLOCK_SIZE - chunk);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+out:
+	brelse(disk_inode_bh);
+	quickfs_journal_stop(sb);
+	up(&quickfs_zlib_lock);
+	return ret;
+}
+
+static int quickfs_compressed_readpage(struct file *file, struct page *page) {
+
+	struct inode *inode = page->mapping->host;
+
+	void *data = kmap(page);
+	int ret = quickfs_read_cluster(inode, page->index, data);
+	if (ret) {
+		SetPageError(page);
+	}
+	else {
+		SetPageUptodate(page);
+	}
+	flush_dcache_page(page);
+	kunmap(page);
+	unlock_page(page);
+	return ret;
+}
+
+static int quickfs_compressed_writepage(struct page *page, struct writeback_control *wbc) {
+
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	unsigned long end_index = size >> PAGE_CACHE_SHIFT;
+	unsigned offset = size & (PAGE_CACHE_SIZE - 1);
+
+	// The page was truncated away
+	if (page->index > end_index || (page->index == end_index && !offset)) {
+		unlock_page(page);
+		return 0;
+	}
+
+	void *data = kmap(page);
+	if (page->index == end_index) {
+		memset((char *) data + offset, 0, PAGE_CACHE_SIZE - offset);
+	}
+	int ret = quickfs_write_cluster(inode, page->index, data);
+	kunmap(page);
+
+	if (ret) {
+		SetPageError(page);
+	}
+	unlock_page(page);
+	return ret;
+}
+
+static int quickfs_compressed_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to) {
+
+	if (PageUptodate(page) || (from == 0 && to == PAGE_CACHE_SIZE)) {
+		return 0;
+	}
+
+	// Partial writes need the rest of the cluster
+	void *data = kmap(page);
+	int ret = quickfs_read_cluster(page->mapping->host, page->index, data);
+	kunmap(page);
+	if (!ret) {
+		SetPageUptodate(page);
+	}
+	return ret;
+}
+
+static int quickfs_compressed_commit_write(struct file *file, struct page *page, unsigned from, unsigned to) {
+
+	struct inode *inode = page->mapping->host;
+	loff_t pos = ((loff_t) page->index << PAGE_CACHE_SHIFT) + to;
+
+	SetPageUptodate(page);
+	set_page_dirty(page);
+	if (pos > inode->i_size) {
+		i_size_write(inode, pos);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static struct address_space_operations quickfs_compressed_addr_space_ops = {
+	.readpage = quickfs_compressed_readpage,
+	.writepage = quickfs_compressed_writepage,
+	.set_page_dirty = __set_page_dirty_nobuffers,
+	.prepare_write = quickfs_compressed_prepare_write,
+	.commit_write = quickfs_compressed_commit_write
+};
+
+/*
+ * Reserves data blocks so the file has len bytes of backing store, filling
+ * any holes below len and taking the blocks from a single contiguous run
+ * when one is free. The blocks are
+ * marked unwritten, so they read as zeros until something is written to
+ * them, and the file size is left alone.
+ */
+static int quickfs_preallocate(struct inode *inode, loff_t len) {
+
+	struct super_block *sb = inode->i_sb;
 	int retval = 0;
 
-	// Check for free inode on disk
+	if (len < 0) {
+		return -EINVAL;
+	}
+	if (len > sb->s_maxbytes) {
+		return -EFBIG;
+	}
+	if (inode->i_mapping->a_ops == &quickfs_compressed_addr_space_ops) {
+		return -EOPNOTSUPP;
+	}
+	unsigned long wanted = (len + QUICKFS_BLOCK_SIZE - 1) >> QUICKFS_BLOCK_SIZE_BITS;
+
+	quickfs_journal_start(sb);
+
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+
+	// Holes below the new length are filled along with the slots past the end of the map
+	unsigned long have = disk_inode->data_block_count;
+	unsigned long count = 0;
+	unsigned long i;
+	for (i = 0; i < wanted; ++i) {
+		if (i >= have || disk_inode->data_blocks[i] == DATA_BLOCK_HOLE) count++;
+	}
+	if (!count) {
+		goto out;
+	}
+
+	unsigned short blocks[MAX_DATA_BLOCKS_PER_INODE];
+	retval = quickfs_alloc_data_blocks(sb, blocks, count);
+	if (retval) {
+		goto out;
+	}
+
+	unsigned long next = 0;
+	for (i = 0; i < wanted; ++i) {
+		if (i >= have || disk_inode->data_blocks[i] == DATA_BLOCK_HOLE) {
+			disk_inode->data_blocks[i] = blocks[next++] | DATA_BLOCK_UNWRITTEN;
+		}
+	}
+	if (wanted > have) {
+		disk_inode->data_block_count = wanted;
+	}
+	quickfs_journal_dirty(sb, disk_inode_bh);
+	inode->i_blocks += count;
+
+out:
+	brelse(disk_inode_bh);
+	quickfs_journal_stop(sb);
+	return retval;
+}
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/*
+ * Returns where SEEK_DATA or SEEK_HOLE from offset lands. Holes and
+ * unwritten blocks count as holes, and there is always a hole at the end
+ * of the file. Compressed files are mapped a cluster at a time, and a
+ * cluster with any blocks is data.
+ */
+static loff_t quickfs_seek_hole_data(struct inode *inode, loff_t offset, int origin) {
+
 	struct super_block *sb = inode->i_sb;
-	struct buffer_head *inode_bm_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
-	int free_inode_num = first_free_bit(&inode_bm_bh, NUM_INODE_BITMAP_BLOCKS);
-	if (free_inode_num < 0) {return -ENOSPC;}
 
-	// Allocate new in-memory inode
-	struct inode *created_inode = new_inode(sb);
-	if (!created_inode)	return -ENOMEM;
+	if (offset < 0 || offset >= inode->i_size) {
+		return -ENXIO;
+	}
+
+	// Pages dirtied through mmap only get their blocks at writeback
+	filemap_fdatawrite(inode->i_mapping);
+	filemap_fdatawait(inode->i_mapping);
+
+	unsigned long step = 1;
+	if (inode->i_mapping->a_ops == &quickfs_compressed_addr_space_ops) {
+		step = QUICKFS_CLUSTER_BLOCKS;
+	}
+
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	if (!disk_inode_bh) {
+		return -EIO;
+	}
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+
+	unsigned long block = (unsigned long) (offset >> QUICKFS_BLOCK_SIZE_BITS) / step * step;
+	for (; ((loff_t) block << QUICKFS_BLOCK_SIZE_BITS) < inode->i_size; block += step) {
+		int data = block < disk_inode->data_block_count &&
+			disk_inode->data_blocks[block] != DATA_BLOCK_HOLE &&
+			!(disk_inode->data_blocks[block] & DATA_BLOCK_UNWRITTEN);
+		if (data == (origin == SEEK_DATA)) {
+			break;
+		}
+	}
+	brelse(disk_inode_bh);
+
+	loff_t found = (loff_t) block << QUICKFS_BLOCK_SIZE_BITS;
+	if (found >= inode->i_size) {
+		return origin == SEEK_DATA ? -ENXIO : inode->i_size;
+	}
+	return found > offset ? found : offset;
+}
+
+static loff_t quickfs_llseek(struct file *file, loff_t offset, int origin) {
+
+	struct inode *inode = file->f_dentry->d_inode;
+
+	if (origin != SEEK_DATA && origin != SEEK_HOLE) {
+		return generic_file_llseek(file, offset, origin);
+	}
+
+	down(&inode->i_sem);
+	loff_t retval = quickfs_seek_hole_data(inode, offset, origin);
+	if (retval >= 0 && retval != file->f_pos) {
+		file->f_pos = retval;
+		file->f_version = 0;
+	}
+	up(&inode->i_sem);
+	return retval;
+}
+
+/*
+ * block_truncate_page zeroes the end of the new last block in place, so a
+ * shared one has to be copied first and its buffer pointed at the copy
+ */
+static void quickfs_unshare_tail(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	unsigned long block = inode->i_size >> QUICKFS_BLOCK_SIZE_BITS;
+
+	if (!QUICKFS_SB(sb)->shared_blocks || !(inode->i_size & (QUICKFS_BLOCK_SIZE - 1))) {
+		return;
+	}
+
+	quickfs_journal_start(sb);
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	int copied = 0;
+	if (disk_inode_bh) {
+		struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+		if (block < disk_inode->data_block_count) {
+			copied = quickfs_unshare_block(sb, disk_inode_bh, block) > 0;
+		}
+		brelse(disk_inode_bh);
+	}
+	quickfs_journal_stop(sb);
+
+	if (!copied) {
+		return;
+	}
+
+	struct page *page = find_lock_page(inode->i_mapping, inode->i_size >> PAGE_CACHE_SHIFT);
+	if (!page) {
+		return;
+	}
+	if (page_has_buffers(page)) {
+		struct buffer_head *bh = page_buffers(page);
+		unsigned long first = (unsigned long) page->index << (PAGE_CACHE_SHIFT - QUICKFS_BLOCK_SIZE_BITS);
+		for (; first < block; ++first) {
+			bh = bh->b_this_page;
+		}
+		clear_buffer_mapped(bh);
+	}
+	unlock_page(page);
+	page_cache_release(page);
+}
+
+/*
+ * Called by vmtruncate once i_size has been changed. Every block past the
+ * new end of file, preallocated or not, goes back to the data bitmap in
+ * one batch.
+ */
+static void quickfs_truncate(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+
+	if (!S_ISREG(inode->i_mode)) {
+		return;
+	}
+	quickfs_trace(sb, QUICKFS_TRACE_TRUNCATE, inode->i_ino, NULL, inode->i_size, 0);
+
+	unsigned long keep;
+	if (inode->i_mapping->a_ops == &quickfs_compressed_addr_space_ops) {
+		unsigned long cluster = inode->i_size >> PAGE_CACHE_SHIFT;
+		unsigned offset = inode->i_size & (QUICKFS_CLUSTER_SIZE - 1);
+
+		/*
+		 * Rewrite the last cluster so nothing past the new end of file
+		 * survives in it. Its page is locked throughout, so writepage can't
+		 * store newer data in between. An uptodate page is the newest copy of
+		 * the cluster and only needs its tail zeroed and writing back.
+		 */
+		if (offset) {
+			struct page *page = find_lock_page(inode->i_mapping, cluster);
+			if (page && PageUptodate(page)) {
+				char *data = kmap(page);
+				memset(data + offset, 0, PAGE_CACHE_SIZE - offset);
+				flush_dcache_page(page);
+				kunmap(page);
+				set_page_dirty(page);
+			}
+			else {
+				void *data = kmalloc(QUICKFS_CLUSTER_SIZE, GFP_KERNEL);
+				if (data && !quickfs_read_cluster(inode, cluster, data)) {
+					memset((char *) data + offset, 0, QUICKFS_CLUSTER_SIZE - offset);
+					quickfs_write_cluster(inode, cluster, data);
+				}
+				kfree(data);
+			}
+			if (page) {
+				unlock_page(page);
+				page_cache_release(page);
+			}
+		}
+		keep = ((inode->i_size + QUICKFS_CLUSTER_SIZE - 1) / QUICKFS_CLUSTER_SIZE) * QUICKFS_CLUSTER_BLOCKS;
+	}
+	else {
+		quickfs_unshare_tail(inode);
+		block_truncate_page(inode->i_mapping, inode->i_size, quickfs_get_block);
+		keep = (inode->i_size + QUICKFS_BLOCK_SIZE - 1) >> QUICKFS_BLOCK_SIZE_BITS;
+	}
+
+	quickfs_journal_start(sb);
+
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
+	if (keep < disk_inode->data_block_count) {
+		int i;
+		for (i = keep; i < disk_inode->data_block_count; ++i) {
+			if (disk_inode->data_blocks[i] != DATA_BLOCK_HOLE) inode->i_blocks--;
+		}
+		quickfs_free_data_blocks(sb, disk_inode->data_blocks + keep, disk_inode->data_block_count - keep);
+		disk_inode->data_block_count = keep;
+		quickfs_journal_dirty(sb, disk_inode_bh);
+	}
+	brelse(disk_inode_bh);
+
+	quickfs_journal_stop(sb);
+
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(inode);
+}
+
+static int quickfs_get_flags(struct inode *inode) {
+
+	struct buffer_head *bh = sb_bread(inode->i_sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	if (!bh) {
+		return -EIO;
+	}
+	int flags = ((struct quickfs_inode *) bh->b_data)->flags;
+	brelse(bh);
+	return flags;
+}
+
+/*
+ * Setting QUICKFS_COMPRESS_FL on the root directory makes every file created
+ * afterwards compressed. A regular file can only switch while it is empty.
+ */
+static int quickfs_set_flags(struct inode *inode, int flags) {
+
+	struct super_block *sb = inode->i_sb;
+	int retval = 0;
+
+	if (current->fsuid != inode->i_uid && !capable(CAP_FOWNER)) {
+		return -EPERM;
+	}
+	if (flags & ~QUICKFS_USER_FLAGS) {
+		return -EINVAL;
+	}
+
+	down(&inode->i_sem);
+	quickfs_journal_start(sb);
+
+	struct buffer_head *bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
+	struct quickfs_inode *disk_inode = (struct quickfs_inode *) bh->b_data;
+
+	if (S_ISREG(inode->i_mode) && ((disk_inode->flags ^ flags) & QUICKFS_COMPRESS_FL)) {
+		if (inode->i_size || disk_inode->data_block_count || inode->i_mapping->nrpages) {
+			retval = -EBUSY;
+			goto out;
+		}
+		inode->i_mapping->a_ops = (flags & QUICKFS_COMPRESS_FL) ?
+			&quickfs_compressed_addr_space_ops : &quickfs_addr_space_ops;
+	}
+
+	disk_inode->flags = (disk_inode->flags & ~QUICKFS_USER_FLAGS) | flags;
+	quickfs_journal_dirty(sb, bh);
+
+out:
+	brelse(bh);
+	quickfs_journal_stop(sb);
+	up(&inode->i_sem);
+	return retval;
+}
+
+static int quickfs_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg) {
+
+	switch (cmd) {
+		case QUICKFS_IOC_GETFLAGS: {
+			int flags = quickfs_get_flags(inode);
+			if (flags < 0) return flags;
+			return put_user(flags & QUICKFS_USER_FLAGS, (int __user *) arg);
+			}
+		case QUICKFS_IOC_SETFLAGS: {
+			int flags;
+			if (get_user(flags, (int __user *) arg)) return -EFAULT;
+			return quickfs_set_flags(inode, flags);
+			}
+		case QUICKFS_IOC_PREALLOCATE: {
+			loff_t len;
+			if (!S_ISREG(inode->i_mode)) return -ENOTTY;
+			if (!(file->f_mode & FMODE_WRITE)) return -EBADF;
+			if (copy_from_user(&len, (loff_t __user *) arg, sizeof(len))) return -EFAULT;
+			return quickfs_preallocate(inode, len);
+			}
+		case QUICKFS_IOC_SEEK_DATA:
+		case QUICKFS_IOC_SEEK_HOLE: {
+			loff_t offset;
+			if (!S_ISREG(inode->i_mode)) return -ENOTTY;
+			if (copy_from_user(&offset, (loff_t __user *) arg, sizeof(offset))) return -EFAULT;
+			down(&inode->i_sem);
+			offset = quickfs_seek_hole_data(inode, offset, cmd == QUICKFS_IOC_SEEK_DATA ? SEEK_DATA : SEEK_HOLE);
+			up(&inode->i_sem);
+			if (offset < 0) return offset;
+			return copy_to_user((loff_t __user *) arg, &offset, sizeof(offset)) ? -EFAULT : 0;
+			}
+		case QUICKFS_IOC_READTRACE:
+			return quickfs_read_trace(inode->i_sb, (struct quickfs_trace_buffer __user *) arg);
+		case QUICKFS_IOC_BATCH:
+			return quickfs_batch(inode, file, (struct quickfs_batch __user *) arg);
+	}
+
+	return -ENOTTY;
+}
+
+static int quickfs_readpage(struct file *file, struct page *page){
+	return block_read_full_page(page, quickfs_get_block);
+}
+
+static int quickfs_writepage(struct page *page, struct writeback_control *wbc){
+	quickfs_unmap_shared_buffers(page);
+	return block_write_full_page(page, quickfs_get_block, wbc);
+}
+
+static int quickfs_fsync(struct file *file, struct dentry *dentry, int datasync) {
+
+	// file_fsync doesn't wait on the inode, which would leave held-back timestamps behind
+	quickfs_flush_lazy_inode(dentry->d_inode);
+	int ret = file_fsync(file, dentry, datasync);
+	quickfs_journal_sync(dentry->d_inode->i_sb);
+	return ret;
+}
+
+static ssize_t quickfs_file_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+
+	ssize_t ret = generic_file_read(file, buf, count, ppos);
+	if (ret > 0) {
+		struct dentry *dentry = file->f_dentry;
+		quickfs_trace(dentry->d_sb, QUICKFS_TRACE_READ, dentry->d_inode->i_ino, &dentry->d_name, *ppos - ret, ret);
+	}
+	return ret;
+}
+
+static ssize_t quickfs_file_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+
+	ssize_t ret = generic_file_write(file, buf, count, ppos);
+	if (ret > 0) {
+		struct dentry *dentry = file->f_dentry;
+		quickfs_trace(dentry->d_sb, QUICKFS_TRACE_WRITE, dentry->d_inode->i_ino, &dentry->d_name, *ppos - ret, ret);
+	}
+	return ret;
+}
+
+static int quickfs_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to){
+	quickfs_unmap_shared_buffers(page);
+	return block_prepare_write(page, from, to, quickfs_get_block);
+}
+
+static struct address_space_operations quickfs_addr_space_ops = {
+	.readpage = quickfs_readpage,
+	.writepage = quickfs_writepage,
+	.sync_page = block_sync_page,
+	.prepare_write = quickfs_prepare_write,
+	.commit_write = generic_commit_write
+};
+
+static struct file_operations quickfs_file_ops = {
+	.llseek = quickfs_llseek,
+	.read = quickfs_file_read,
+	.write = quickfs_file_write,
+	.ioctl = quickfs_ioctl,
+	.mmap = generic_file_mmap,
+	.sendfile = generic_file_sendfile,
+	.fsync = quickfs_fsync
+};
+
+/*
+ * Create, link and unlink are split into the helpers below so that
+ * QUICKFS_IOC_BATCH can run many of them in one journal handle. Each is
+ * called inside a handle, and the caller owns the inode bitmap and the
+ * superblock's free inode count: it hands create and link a disk inode it
+ * has already found free, and unlink hands back the link record it freed.
+ * Memory reclaim can evict and delete inodes, which takes the journal, so
+ * create is also handed an in-memory inode allocated before the handle.
+ */
+
+static void quickfs_count_inodes(struct super_block *sb, long delta) {
+
+	if (!delta) return;
+
+	struct buffer_head *quickfs_sb_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+	struct quickfs_sb *disk_sb = (struct quickfs_sb *) quickfs_sb_bh->b_data;
+	disk_sb->inodes_free += delta;
+	quickfs_journal_dirty(sb, quickfs_sb_bh);
+	brelse(quickfs_sb_bh);
+}
+
+static int quickfs_create_inode(struct inode *dir, struct dentry *dentry, int mode, int ino, struct inode *created_inode) {
+
+	struct super_block *sb = dir->i_sb;
+
+	long slot = quickfs_name_insert(sb, &dentry->d_name, ino);
+	if (slot < 0) {
+		return slot;
+	}
 
 	// Populate new in-memory inode
-	created_inode->i_ino = free_inode_num;
+	created_inode->i_ino = ino;
 	created_inode->i_mode = mode;
 	created_inode->i_blksize = QUICKFS_BLOCK_SIZE;
 	created_inode->i_sb = sb;
@@ -333,76 +2236,41 @@ static int quickfs_create(struct inode *inode, struct dentry *dentry, int mode,
 	created_inode->i_mapping->a_ops = &quickfs_addr_space_ops;
 	created_inode->i_mode |= S_IFREG;
 
+	// New files inherit the directory's compression setting
+	int dir_flags = quickfs_get_flags(dir);
+	int flags = dir_flags > 0 ? dir_flags & QUICKFS_COMPRESS_FL : 0;
+	if (flags & QUICKFS_COMPRESS_FL) {
+		created_inode->i_mapping->a_ops = &quickfs_compressed_addr_space_ops;
+	}
+
 	// Write new quickfs_inode to disk
-	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(free_inode_num));
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(ino));
 	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
 	strcpy(disk_inode->name, dentry->d_name.name);
 	disk_inode->size = 0;
 	disk_inode->data_block_count = 0;
 	disk_inode->hard_links = 1;
+	disk_inode->flags = flags;
 	disk_inode->link = -1;
 	disk_inode->uid = created_inode->i_uid;
 	disk_inode->gid = created_inode->i_gid;
 	disk_inode->umode = created_inode->i_mode;
 	disk_inode->atime = disk_inode->mtime = disk_inode->ctime = created_inode->i_ctime;
-	mark_buffer_dirty(disk_inode_bh);
+	quickfs_journal_dirty(sb, disk_inode_bh);
 	brelse(disk_inode_bh);
-
-	// Modify on-disk superblock
-	struct buffer_head *quickfs_sb_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
-	struct quickfs_sb *disk_sb = (struct quickfs_sb *) quickfs_sb_bh->b_data;
-	disk_sb->inodes_free--;
-	mark_buffer_dirty(quickfs_sb_bh);
-	brelse(quickfs_sb_bh);
-
-	// Update free inode count in quickfs_sb
-	mark_bit(inode_bm_bh, free_inode_num);
-	mark_buffer_dirty(inode_bm_bh);
-	brelse(inode_bm_bh);
+	quickfs_inode_synced(created_inode);
 
 	// Mark the inode we created as dirty
 	insert_inode_hash(created_inode);
 	mark_inode_dirty(created_inode);
 
 	// Instantiate dentry
-	d_instantiate(dentry, created_inode);	
-
-	return retval;
-}
-
-struct dentry *quickfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nameidata) {
-
-	struct inode * inode = NULL;
-
-	if (dentry->d_name.len > MAX_NAME_LENGTH) return ERR_PTR(-ENAMETOOLONG);
-
-	int i;
-	struct buffer_head *inode_bitmap_bh = sb_bread(dir->i_sb, INODE_BITMAP_BLOCK_NUM);
-	for (i = 0; i < 4096; ++i) {
-		if (test_for_bit(inode_bitmap_bh, i)) {
-			struct buffer_head *inode_bh = sb_bread(dir->i_sb, INODE_NUM_TO_BLOCK_NUM(i));
-			struct quickfs_inode *disk_inode = (struct quickfs_inode *) inode_bh->b_data;
-			if (strcmp(dentry->d_iname, disk_inode->name) == 0) {
-				int ino = i;
-				if (disk_inode->link > 0) {
-					ino = disk_inode->link;
-				}
-				brelse(inode_bh);
-				inode = iget(dir->i_sb, ino);
-				if (!inode) {return ERR_PTR(-EACCES);}
-				d_add(dentry, inode);
-				goto out;
-			}
-			brelse(inode_bh);
-		}
-	}
-
-out:
-	brelse(inode_bitmap_bh);
-	return NULL;
+	d_instantiate(dentry, created_inode);
+	quickfs_trace(sb, QUICKFS_TRACE_CREATE, ino, &dentry->d_name, 0, 0);
+	return 0;
 }
 
-static int quickfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry) {
+static int quickfs_link_inode(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry, int ino) {
 
 	/*
 		Basic process:
@@ -412,55 +2280,36 @@ static int quickfs_link(struct dentry *old_dentry, struct inode *dir, struct den
 		d_instantiate new_dentry with referrenced_inode
 
 		We also:
-		Go to disk and find a free disk inode
-		Write new_dentry.name to disk inode
+		Write new_dentry.name to the free disk inode
 		Write referrenced_inode.number to disk_inode.link
-		Modify on disk superblock
 	*/
 	struct inode * referrenced_inode = old_dentry->d_inode;
 	struct super_block *sb = referrenced_inode->i_sb;
 
-	// Check for free inode in bitmap
-	struct buffer_head *inode_bm_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
-	int free_disk_inode_num = first_free_bit(&inode_bm_bh, NUM_INODE_BITMAP_BLOCKS);
-	if (free_disk_inode_num < 0) {
-		brelse(inode_bm_bh);
-		return -ENOSPC;
-	}
+	long slot = quickfs_name_insert(sb, &new_dentry->d_name, ino);
+	if (slot < 0) return slot;
 
 	// Get free inode from disk
-	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(free_disk_inode_num));
+	struct buffer_head *disk_inode_bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(ino));
 	struct quickfs_inode *disk_inode = (struct quickfs_inode *) disk_inode_bh->b_data;
 
 	// Write appropriate fields to inode
 	strcpy(disk_inode->name, new_dentry->d_name.name);
 	disk_inode->link = referrenced_inode->i_ino;	
-	mark_buffer_dirty(disk_inode_bh);
+	quickfs_journal_dirty(sb, disk_inode_bh);
 	brelse(disk_inode_bh);
 
-	// Mark disk_inode as used
-	mark_bit(inode_bm_bh, free_disk_inode_num);
-	mark_buffer_dirty(inode_bm_bh);
-	brelse(inode_bm_bh);
-
-	// Alter on-disk superblock to reflect decrease in inodes
-	struct buffer_head *superblock_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
-	struct quickfs_sb *disk_sb = (struct quickfs_sb *) superblock_bh->b_data;
-	disk_sb->inodes_free--;
-	mark_buffer_dirty(superblock_bh);
-	brelse(superblock_bh);	
-
 	// Modify referrenced inode appropriately
 	referrenced_inode->i_nlink++;
 	referrenced_inode->i_ctime = CURRENT_TIME;
-	referrenced_inode->i_atime = referrenced_inode->i_ctime;
 	mark_inode_dirty(referrenced_inode);
 	atomic_inc(&referrenced_inode->i_count);
 	d_instantiate(new_dentry, referrenced_inode);
+	quickfs_trace(sb, QUICKFS_TRACE_LINK, referrenced_inode->i_ino, &new_dentry->d_name, 0, 0);
 	return 0;
 }
 
-static int quickfs_unlink(struct inode *dir, struct dentry *dentry) {
+static int quickfs_unlink_inode(struct inode *dir, struct dentry *dentry, int *freed) {
 
 	/**
 	 * All unlink possibilities
@@ -497,101 +2346,488 @@ static int quickfs_unlink(struct inode *dir, struct dentry *dentry) {
 
 	struct super_block *sb = dir->i_sb;
 	struct inode *inode = dentry->d_inode;
-	const char *name = dentry->d_name.name;	
+	unsigned long slot;
 
-	struct buffer_head *bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(inode->i_ino));
-	struct quickfs_inode *disk_inode = (struct quickfs_inode *) bh->b_data;
+	// The primary inode holds the name (cases a), or a link record does (cases b)
+	int ino = quickfs_name_find(sb, &dentry->d_name, 0, &slot, NULL);
+	if (ino != inode->i_ino) {
+		ino = quickfs_name_find(sb, &dentry->d_name, inode->i_ino, &slot, NULL);
+	}
+	if (ino < 0) return ino == -ENOENT ? -EIO : ino;
+	quickfs_name_remove(sb, slot);
+
+	*freed = -1;
+	if (ino == inode->i_ino) {
+		// With links left, the primary inode only loses its name
+		if (inode->i_nlink > 1) {
+			struct buffer_head *bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(ino));
+			((struct quickfs_inode *) bh->b_data)->name[0] = '\0';
+			quickfs_journal_dirty(sb, bh);
+			brelse(bh);
+		}
+	}
+	else {
+		// The link record itself goes away
+		*freed = ino;
+	}
+
+	inode->i_nlink--;
+	mark_inode_dirty(inode);
+	quickfs_trace(sb, QUICKFS_TRACE_UNLINK, inode->i_ino, &dentry->d_name, 0, 0);
+	return 0;
+}
+
+static int quickfs_create(struct inode *inode, struct dentry *dentry, int mode, struct nameidata *nameidata) {
+	
+	int retval = 0;
+
+	struct super_block *sb = inode->i_sb;
+	struct inode *created_inode = new_inode(sb);
+	if (!created_inode) {
+		return -ENOMEM;
+	}
+
+	// Check for free inode on disk
+	quickfs_journal_start(sb);
+	struct buffer_head *inode_bm_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
+	int free_inode_num = first_free_bit(&inode_bm_bh, NUM_INODE_BITMAP_BLOCKS);
+	if (free_inode_num < 0) {
+		retval = -ENOSPC;
+		goto out;
+	}
+
+	retval = quickfs_create_inode(inode, dentry, mode, free_inode_num, created_inode);
+	if (retval) goto out;
+
+	// Update free inode count
+	mark_bit(inode_bm_bh, free_inode_num);
+	quickfs_journal_dirty(sb, inode_bm_bh);
+	quickfs_count_inodes(sb, -1);
+
+out:
+	brelse(inode_bm_bh);
+	quickfs_journal_stop(sb);
+	if (retval) {
+		iput(created_inode);
+	}
+	return retval;
+}
+
+struct dentry *quickfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nameidata) {
+
+	if (dentry->d_name.len > MAX_NAME_LENGTH) return ERR_PTR(-ENAMETOOLONG);
+
+	int link;
+	int ino = quickfs_name_find(dir->i_sb, &dentry->d_name, 0, NULL, &link);
+	if (ino == -EIO) {
+		return ERR_PTR(-EIO);
+	}
+
+	// A name the table doesn't know gets a negative dentry
+	struct inode *inode = NULL;
+	if (ino >= 0) {
+		inode = iget(dir->i_sb, link > 0 ? link : ino);
+		if (!inode) return ERR_PTR(-EACCES);
+	}
+	d_add(dentry, inode);
+	return NULL;
+}
+
+static int quickfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry) {
+
+	struct super_block *sb = dir->i_sb;
+	int retval = 0;
+
+	quickfs_journal_start(sb);
+
+	// Check for free inode in bitmap
+	struct buffer_head *inode_bm_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
+	int free_disk_inode_num = first_free_bit(&inode_bm_bh, NUM_INODE_BITMAP_BLOCKS);
+	if (free_disk_inode_num < 0) {
+		retval = -ENOSPC;
+		goto out;
+	}
+
+	retval = quickfs_link_inode(old_dentry, dir, new_dentry, free_disk_inode_num);
+	if (retval) goto out;
+
+	// Mark disk_inode as used
+	mark_bit(inode_bm_bh, free_disk_inode_num);
+	quickfs_journal_dirty(sb, inode_bm_bh);
+	quickfs_count_inodes(sb, -1);
+
+out:
+	brelse(inode_bm_bh);
+	quickfs_journal_stop(sb);
+	return retval;
+}
+
+static int quickfs_unlink(struct inode *dir, struct dentry *dentry) {
+
+	struct super_block *sb = dir->i_sb;
+	int freed;
+
+	quickfs_journal_start(sb);
+	int retval = quickfs_unlink_inode(dir, dentry, &freed);
+	if (!retval && freed >= 0) {
+		struct buffer_head *inode_bitmap_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
+		clear_bitmap_bit(inode_bitmap_bh, freed);
+		quickfs_journal_dirty(sb, inode_bitmap_bh);
+		brelse(inode_bitmap_bh);
+		quickfs_count_inodes(sb, 1);
+	}
+	quickfs_journal_stop(sb);
+	return retval;
+}
+
+/*
+	Batched directory operations
+*/
+
+// A disk inode and up to two name table blocks
+#define QUICKFS_BATCH_OP_BLOCKS 3
+// Creates run in a handle until it might not hold another, leaving room for the bitmap and superblock
+#define QUICKFS_BATCH_HANDLE_OPS ((JOURNAL_MAX_HANDLE_BLOCKS - 2) / QUICKFS_BATCH_OP_BLOCKS)
+
+struct quickfs_batch_state {
+	struct inode *dir;
+	struct dentry *parent;
+	struct buffer_head *inode_bm_bh;
+
+	// Free disk inodes found by one pass over the bitmap, handed out in order
+	int *inos;
+	int found;
+	int used;
+
+	/*
+	 * Looked up and allocated for each create before the first handle,
+	 * since both allocate with GFP_KERNEL and reclaim can take the journal
+	 */
+	struct dentry **dentries;
+	struct inode **inodes;
+
+	long inodes_free;	// Change to the superblock's count not written yet
+	int handle_ops;		// Ops run in the current handle, -1 outside one
+};
+
+static void quickfs_batch_start(struct super_block *sb, struct quickfs_batch_state *state) {
+
+	quickfs_journal_start(sb);
+	state->handle_ops = 0;
+}
+
+static void quickfs_batch_stop(struct super_block *sb, struct quickfs_batch_state *state) {
+
+	if (state->handle_ops < 0) return;
+
+	quickfs_count_inodes(sb, state->inodes_free);
+	state->inodes_free = 0;
+	quickfs_journal_stop(sb);
+	state->handle_ops = -1;
+}
+
+static struct dentry *quickfs_batch_lookup(struct dentry *parent, const char *name) {
+
+	int len = strlen(name);
+	if (!strcmp(name, ".") || !strcmp(name, "..")) return ERR_PTR(-EINVAL);
+	return lookup_one_len(name, parent, len);
+}
+
+/*
+ * The checks vfs_create, vfs_link and vfs_unlink make before calling into
+ * the filesystem, which the batch bypasses, returning the errno the
+ * syscall would
+ */
+static int quickfs_batch_may_create(struct inode *dir, struct dentry *dentry) {
+
+	if (dentry->d_inode) return -EEXIST;
+	if (IS_DEADDIR(dir)) return -ENOENT;
+	return permission(dir, MAY_WRITE | MAY_EXEC, NULL);
+}
+
+static int quickfs_batch_may_link(struct inode *dir, struct dentry *target, struct dentry *dentry) {
+
+	struct inode *inode = target->d_inode;
+	if (!inode) return -ENOENT;
+
+	int retval = quickfs_batch_may_create(dir, dentry);
+	if (retval) return retval;
+	if (IS_APPEND(inode) || IS_IMMUTABLE(inode)) return -EPERM;
+	if (S_ISDIR(inode->i_mode)) return -EPERM;
+	return security_inode_link(target, dir, dentry);
+}
+
+static int quickfs_batch_may_delete(struct inode *dir, struct dentry *victim) {
+
+	struct inode *inode = victim->d_inode;
+	if (!inode) return -ENOENT;
+
+	int retval = permission(dir, MAY_WRITE | MAY_EXEC, NULL);
+	if (retval) return retval;
+	if (IS_APPEND(dir)) return -EPERM;
+
+	// In a sticky directory only the owner of the file or the directory may remove it
+	if ((dir->i_mode & S_ISVTX) && current->fsuid != inode->i_uid &&
+		current->fsuid != dir->i_uid && !capable(CAP_FOWNER))
+	{
+		return -EPERM;
+	}
+	if (IS_APPEND(inode) || IS_IMMUTABLE(inode)) return -EPERM;
+	if (S_ISDIR(inode->i_mode)) return -EISDIR;
+	if (IS_DEADDIR(dir)) return -ENOENT;
+	return 0;
+}
+
+static int quickfs_batch_mode(struct quickfs_batch_op *op) {
+
+	return S_IFREG | (op->mode & S_IALLUGO & ~current->fs->umask);
+}
+
+/*
+ * Looks up a create's name, checks it and allocates its inode, outside any
+ * handle. A failed check takes the place of the dentry. A name that exists
+ * is left to fail with -EEXIST when the create runs, unless an unlink
+ * earlier in the batch removes it first.
+ */
+static void quickfs_batch_prepare_create(struct quickfs_batch_state *state, struct quickfs_batch_op *op, int i) {
+
+	struct dentry *dentry = quickfs_batch_lookup(state->parent, op->name);
+	state->dentries[i] = dentry;
+	if (IS_ERR(dentry) || dentry->d_inode) return;
+
+	int retval = quickfs_batch_may_create(state->dir, dentry);
+	if (!retval) retval = security_inode_create(state->dir, dentry, quickfs_batch_mode(op));
+	if (retval) {
+		dput(dentry);
+		state->dentries[i] = ERR_PTR(retval);
+		return;
+	}
+
+	if (!state->inodes[i]) state->inodes[i] = new_inode(state->dir->i_sb);
+}
+
+static int quickfs_batch_create(struct quickfs_batch_state *state, struct quickfs_batch_op *op, int i) {
+
+	struct super_block *sb = state->dir->i_sb;
+	int retval;
+
+	// An unlink earlier in the batch drops the dentry, so prepare the name again
+	if (!IS_ERR(state->dentries[i]) && d_unhashed(state->dentries[i])) {
+		quickfs_batch_stop(sb, state);
+		dput(state->dentries[i]);
+		quickfs_batch_prepare_create(state, op, i);
+	}
+
+	struct dentry *dentry = state->dentries[i];
+	if (IS_ERR(dentry)) return PTR_ERR(dentry);
+	if (dentry->d_inode) return -EEXIST;
+	if (!state->inodes[i]) return -ENOMEM;
+	if (state->used == state->found) return -ENOSPC;
+
+	if (state->handle_ops == QUICKFS_BATCH_HANDLE_OPS) quickfs_batch_stop(sb, state);
+	if (state->handle_ops < 0) quickfs_batch_start(sb, state);
+	state->handle_ops++;
+
+	int ino = state->inos[state->used];
+	retval = quickfs_create_inode(state->dir, dentry, quickfs_batch_mode(op), ino, state->inodes[i]);
+	if (retval) return retval;
+
+	state->inodes[i] = NULL;
+	state->used++;
+	mark_bit(state->inode_bm_bh, ino);
+	quickfs_journal_dirty(sb, state->inode_bm_bh);
+	state->inodes_free--;
+	return 0;
+}
+
+static int quickfs_batch_link(struct quickfs_batch_state *state, struct quickfs_batch_op *op) {
+
+	struct super_block *sb = state->dir->i_sb;
+	struct dentry *dentry;
+	int retval;
+
+	// As in vfs_link, the target's i_sem is taken before the journal
+	quickfs_batch_stop(sb, state);
 
+	struct dentry *target = quickfs_batch_lookup(state->parent, op->target);
+	if (IS_ERR(target)) return PTR_ERR(target);
+	dentry = quickfs_batch_lookup(state->parent, op->name);
+	if (IS_ERR(dentry)) {
+		retval = PTR_ERR(dentry);
+		goto out_target;
+	}
+
+	retval = quickfs_batch_may_link(state->dir, target, dentry);
+	if (retval) goto out;
+	retval = -ENOSPC;
+	if (state->used == state->found) goto out;
+
+	struct inode *inode = target->d_inode;
+	int ino = state->inos[state->used];
+	down(&inode->i_sem);
+	quickfs_batch_start(sb, state);
+	retval = quickfs_link_inode(target, state->dir, dentry, ino);
+	if (!retval) {
+		state->used++;
+		mark_bit(state->inode_bm_bh, ino);
+		quickfs_journal_dirty(sb, state->inode_bm_bh);
+		state->inodes_free--;
+	}
+	quickfs_batch_stop(sb, state);
+	up(&inode->i_sem);
+
+out:
+	dput(dentry);
+out_target:
+	dput(target);
+	return retval;
+}
+
+static int quickfs_batch_unlink(struct quickfs_batch_state *state, struct quickfs_batch_op *op) {
+
+	struct super_block *sb = state->dir->i_sb;
+	int retval, freed;
+
+	// As in vfs_unlink, the victim's i_sem is taken before the journal
+	quickfs_batch_stop(sb, state);
+
+	struct dentry *dentry = quickfs_batch_lookup(state->parent, op->name);
+	if (IS_ERR(dentry)) return PTR_ERR(dentry);
+
+	retval = quickfs_batch_may_delete(state->dir, dentry);
+	if (retval) goto out;
+
+	struct inode *inode = dentry->d_inode;
+	down(&inode->i_sem);
+	retval = d_mountpoint(dentry) ? -EBUSY : security_inode_unlink(state->dir, dentry);
+	if (retval) {
+		up(&inode->i_sem);
+		goto out;
+	}
+	quickfs_batch_start(sb, state);
+	retval = quickfs_unlink_inode(state->dir, dentry, &freed);
+	if (!retval && freed >= 0) {
+		clear_bitmap_bit(state->inode_bm_bh, freed);
+		quickfs_journal_dirty(sb, state->inode_bm_bh);
+		state->inodes_free++;
+	}
+	quickfs_batch_stop(sb, state);
+	up(&inode->i_sem);
+
+	// Outside the handle, since dropping the last reference deletes the inode
+	if (!retval) d_delete(dentry);
+
+out:
+	dput(dentry);
+	return retval;
+}
+
+static int quickfs_batch(struct inode *dir, struct file *file, struct quickfs_batch __user *arg) {
+
+	struct super_block *sb = dir->i_sb;
+	struct quickfs_batch batch;
+	struct quickfs_batch_state state;
+	struct quickfs_batch_op *ops = NULL;
+	int retval = 0;
+	int done = 0;
+	int needed = 0;
 	int i;
-	struct buffer_head *inode_bitmap_bh;
 
-	struct buffer_head *disk_sb_bh;
-	struct quickfs_sb *disk_sb;
+	if (!S_ISDIR(dir->i_mode)) return -ENOTDIR;
+	if (copy_from_user(&batch, arg, sizeof(batch))) return -EFAULT;
+	if (batch.count > QUICKFS_BATCH_MAX) return -EINVAL;
+	if (!batch.count) return 0;
+
+	retval = permission(dir, MAY_WRITE | MAY_EXEC, NULL);
+	if (retval) return retval;
+
+	ops = vmalloc(batch.count * sizeof(*ops));
+	state.inos = kmalloc(batch.count * sizeof(int), GFP_KERNEL);
+	state.dentries = kmalloc(batch.count * sizeof(struct dentry *), GFP_KERNEL);
+	state.inodes = kmalloc(batch.count * sizeof(struct inode *), GFP_KERNEL);
+	if (!ops || !state.inos || !state.dentries || !state.inodes) {
+		retval = -ENOMEM;
+		goto out_free;
+	}
+	if (copy_from_user(ops, batch.ops, batch.count * sizeof(*ops))) {
+		retval = -EFAULT;
+		goto out_free;
+	}
 
-	// If there's only one hard link
-	if (inode->i_nlink == 1) {
-		// And the filename matches the filename stored on disk
-		if (strcmp(name, disk_inode->name) == 0) {goto decrease;}
+	// Every create and link takes a disk inode
+	for (i = 0; i < batch.count; ++i) {
+		ops[i].name[MAX_NAME_LENGTH - 1] = '\0';
+		ops[i].target[MAX_NAME_LENGTH - 1] = '\0';
+		if (ops[i].op == QUICKFS_BATCH_CREATE || ops[i].op == QUICKFS_BATCH_LINK) needed++;
+	}
 
-		// And the filename doesn't match the filename stored on disk
-		else {
-			brelse(bh);
-			inode_bitmap_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
-			for (i = 0; i < 4096; ++i) {
-				if (test_for_bit(inode_bitmap_bh, i)) {
-					bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(i));
-					disk_inode = (struct quickfs_inode *) bh->b_data;
-					if (strcmp(name, disk_inode->name) == 0 &&
-						disk_inode->link == inode->i_ino)
-					{
-						goto modify_disk;
-					}
-					else {
-						brelse(bh);
-					}
-				}
-			}
-			brelse(inode_bitmap_bh);
-			goto out_error;
-		}
+	state.dir = dir;
+	state.parent = file->f_dentry;
+	state.used = 0;
+	state.inodes_free = 0;
+	state.handle_ops = -1;
+
+	down(&dir->i_sem);
+	for (i = 0; i < batch.count; ++i) {
+		state.dentries[i] = NULL;
+		state.inodes[i] = NULL;
+		if (ops[i].op == QUICKFS_BATCH_CREATE) quickfs_batch_prepare_create(&state, &ops[i], i);
 	}
 
-	// If there's more than one hard link
-	else {
-		// And the filename matches the filename stored on disk
-		if (strcmp(name, disk_inode->name) == 0) {
-			disk_inode->name[0] = '\0';
-			mark_buffer_dirty(bh);
-			goto decrease;
-		}
-		// And the filename doesn't match the filename stored on disk
-		else {
-			brelse(bh);
-			inode_bitmap_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
-			for (i = 0; i < 4096; ++i) {
-				if (test_for_bit(inode_bitmap_bh, i)) {
-					bh = sb_bread(sb, INODE_NUM_TO_BLOCK_NUM(i));
-					disk_inode = (struct quickfs_inode *) bh->b_data;
-					if (strcmp(name, disk_inode->name) == 0 &&
-						disk_inode->link == inode->i_ino)
-					{
-						goto modify_disk;
-					}
-					else {
-						brelse(bh);
-					} 
-				}
-			}
-			brelse(inode_bitmap_bh);
-			goto out_error;
+	quickfs_batch_start(sb, &state);
+	state.inode_bm_bh = sb_bread(sb, INODE_BITMAP_BLOCK_NUM);
+	state.found = free_bits(state.inode_bm_bh, state.inos, needed);
+
+	for (i = 0; i < batch.count; ++i) {
+		struct quickfs_batch_op *op = &ops[i];
+
+		switch (op->op) {
+			case QUICKFS_BATCH_CREATE:
+				op->result = quickfs_batch_create(&state, op, i);
+				break;
+			case QUICKFS_BATCH_LINK:
+				op->result = quickfs_batch_link(&state, op);
+				break;
+			case QUICKFS_BATCH_UNLINK:
+				op->result = quickfs_batch_unlink(&state, op);
+				break;
+			default:
+				op->result = -EINVAL;
 		}
+		if (!op->result) done++;
+	}
+
+	quickfs_batch_stop(sb, &state);
+	brelse(state.inode_bm_bh);
 
+	// Inodes no create used were never hashed, so dropping them writes nothing
+	for (i = 0; i < batch.count; ++i) {
+		if (state.dentries[i] && !IS_ERR(state.dentries[i])) dput(state.dentries[i]);
+		if (state.inodes[i]) iput(state.inodes[i]);
 	}
+	up(&dir->i_sem);
 
-modify_disk:
-	disk_sb_bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
-	disk_sb = (struct quickfs_sb *) disk_sb_bh->b_data;
-	disk_sb->inodes_free++;
-	clear_bitmap_bit(inode_bitmap_bh, i);
-	mark_buffer_dirty(disk_sb_bh);
-	brelse(disk_sb_bh);
-	mark_buffer_dirty(inode_bitmap_bh);
-	brelse(disk_sb_bh);
-decrease:
-	brelse(bh);
-	inode->i_nlink--;
-	mark_inode_dirty(inode);
-	
-	return 0;
+	for (i = 0; i < batch.count; ++i) {
+		if (put_user(ops[i].result, &batch.ops[i].result)) {
+			retval = -EFAULT;
+			goto out_free;
+		}
+	}
+	retval = done;
 
-out_error:
-	return -1;
+out_free:
+	kfree(state.inodes);
+	kfree(state.dentries);
+	kfree(state.inos);
+	vfree(ops);
+	return retval;
 }
 
 static struct file_operations quickfs_dir_ops = {
 	.readdir = quickfs_readdir,
 	.read = generic_read_dir,
-	.fsync = file_fsync
+	.ioctl = quickfs_ioctl,
+	.fsync = quickfs_fsync
 };
 
 void quickfs_read_inode(struct inode *inode) {
@@ -607,7 +2843,11 @@ void quickfs_read_inode(struct inode *inode) {
 	inode->i_atime = disk_inode->atime;
 	inode->i_mtime = disk_inode->mtime;
 	inode->i_ctime = disk_inode->ctime;
-	inode->i_blocks = disk_inode->data_block_count;
+	inode->i_blocks = 0;
+	int i;
+	for (i = 0; i < disk_inode->data_block_count; ++i) {
+		if (disk_inode->data_blocks[i] != DATA_BLOCK_HOLE) inode->i_blocks++;
+	}
 	inode->i_size = disk_inode->size;
 	inode->i_bytes = disk_inode->size % QUICKFS_BLOCK_SIZE;
 	inode->i_blksize = QUICKFS_BLOCK_SIZE;
@@ -622,33 +2862,136 @@ void quickfs_read_inode(struct inode *inode) {
 		inode->i_mode |= S_IFREG;
 		inode->i_fop = &quickfs_file_ops;
 		inode->i_op = &quickfs_inode_ops;
-		inode->i_mapping->a_ops = &quickfs_addr_space_ops;
+		inode->i_mapping->a_ops = (disk_inode->flags & QUICKFS_COMPRESS_FL) ?
+			&quickfs_compressed_addr_space_ops : &quickfs_addr_space_ops;
 	}
 
 	brelse(bh);
+	quickfs_inode_synced(inode);
+}
+
+static void quickfs_put_super(struct super_block *sb) {
+
+	/*
+	 * sync_fs has written every lazy inode by now and nothing can list
+	 * another, so the lazytime work won't requeue itself. Whatever is still
+	 * listed would hold a reference past unmount, so write it anyway.
+	 */
+	cancel_delayed_work(&QUICKFS_SB(sb)->lazy_work);
+	flush_scheduled_work();
+	quickfs_flush_lazy_inodes(sb, 0);
+
+	quickfs_journal_release(sb);
+	quickfs_trace_release(sb);
+	kfree(sb->s_fs_info);
+	sb->s_fs_info = NULL;
+}
+
+static int quickfs_sync_fs(struct super_block *sb, int wait) {
+
+	quickfs_flush_lazy_inodes(sb, 0);
+	quickfs_journal_sync(sb);
+	return 0;
+}
+
+static int quickfs_remount_fs(struct super_block *sb, int *flags, char *data) {
+
+	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY)) {
+		return 0;
+	}
+	return quickfs_journal_remount(sb, *flags & MS_RDONLY);
 }
 
 static struct super_operations quickfs_sb_ops = {
+	.alloc_inode = quickfs_alloc_inode,
+	.destroy_inode = quickfs_destroy_inode,
 	.read_inode = quickfs_read_inode,
 	.write_inode = quickfs_write_inode,
-	.delete_inode = quickfs_delete_inode
+	.delete_inode = quickfs_delete_inode,
+	.put_super = quickfs_put_super,
+	.sync_fs = quickfs_sync_fs,
+	.remount_fs = quickfs_remount_fs
+};
+
+enum {
+	Opt_trace, Opt_lazytime, Opt_err
 };
 
+static match_table_t quickfs_tokens = {
+	{Opt_trace, "trace"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_err, NULL}
+};
+
+static int quickfs_parse_options(struct super_block *sb, char *options) {
+
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+	int ret;
+
+	if (!options) {
+		return 0;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p) {
+			continue;
+		}
+		switch (match_token(p, quickfs_tokens, args)) {
+			case Opt_trace:
+				if (!QUICKFS_SB(sb)->trace) {
+					ret = quickfs_trace_init(sb);
+					if (ret) return ret;
+				}
+				break;
+			case Opt_lazytime:
+				QUICKFS_SB(sb)->lazytime = 1;
+				break;
+			default:
+				printk(KERN_ERR "quickfs: unrecognized mount option \"%s\"\n", p);
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 int quickfs_fill_super(struct super_block *sb, void *data, int silent) {
 	
+	sb_set_blocksize(sb, QUICKFS_BLOCK_SIZE);
+
+	struct quickfs_sb_info *quickfs_info = kmalloc(sizeof(struct quickfs_sb_info), GFP_KERNEL);
+	if (!quickfs_info) {
+		return -ENOMEM;
+	}
+	sb->s_fs_info = quickfs_info;
+	quickfs_info->trace = NULL;
+	quickfs_info->lazytime = 0;
+	spin_lock_init(&quickfs_info->lazy_lock);
+	INIT_LIST_HEAD(&quickfs_info->lazy_inodes);
+	quickfs_info->lazy_scheduled = 0;
+	INIT_WORK(&quickfs_info->lazy_work, quickfs_lazytime_work, sb);
+
+	int ret = quickfs_parse_options(sb, data);
+	if (ret) {
+		goto out_free;
+	}
+
+	// Bring the metadata up to date before reading any of it
+	ret = quickfs_journal_load(sb);
+	if (ret) {
+		goto out_free;
+	}
+
 	// Read info from disk and create in-memory quickfs_sb
-	struct buffer_head *bh = sb_bread(sb, ROOT_INODE_NUM);
-	struct quickfs_sb *quickfs_disk_sb, *quickfs_info;
-	quickfs_disk_sb = (struct quickfs_sb *) bh->b_data;
-	quickfs_info = kmalloc(sizeof(struct quickfs_sb), GFP_KERNEL);
-	quickfs_info->magic_number = quickfs_disk_sb->magic_number;
-	quickfs_info->data_blocks_free = quickfs_disk_sb->data_blocks_free;
-	quickfs_info->inodes_free = quickfs_disk_sb->inodes_free;
+	struct buffer_head *bh = sb_bread(sb, SUPER_BLOCK_BLOCK_NUM);
+	struct quickfs_sb *quickfs_disk_sb = (struct quickfs_sb *) bh->b_data;
+	quickfs_info->disk_sb.magic_number = quickfs_disk_sb->magic_number;
+	quickfs_info->disk_sb.data_blocks_free = quickfs_disk_sb->data_blocks_free;
+	quickfs_info->disk_sb.inodes_free = quickfs_disk_sb->inodes_free;
 	brelse(bh);	
+	quickfs_info->shared_blocks = quickfs_count_shared_blocks(sb);
 	
 	// Fill in VFS superblock
-	sb_set_blocksize(sb, QUICKFS_BLOCK_SIZE);
-	sb->s_fs_info = quickfs_info;
 	sb->s_magic = MAGIC_NUMBER;
 	sb->s_blocksize = QUICKFS_BLOCK_SIZE;
 	sb->s_blocksize_bits = QUICKFS_BLOCK_SIZE_BITS;
@@ -661,6 +3004,12 @@ int quickfs_fill_super(struct super_block *sb, void *data, int silent) {
 	sb->s_root = d_alloc_root(root_inode);
 	
 	return 0;
+
+out_free:
+	quickfs_trace_release(sb);
+	kfree(quickfs_info);
+	sb->s_fs_info = NULL;
+	return ret;
 }
 
 static struct super_block *quickfs_get_sb(struct file_system_type *fs_type,
@@ -679,11 +3028,34 @@ static struct file_system_type quickfs = {
 };
 
 static int __init quickfs_init(void) {
-	return register_filesystem(&quickfs);
+
+	int ret = quickfs_init_inodecache();
+	if (ret) {
+		return ret;
+	}
+
+	ret = quickfs_zlib_init();
+	if (ret) {
+		goto out_inodecache;
+	}
+
+	ret = register_filesystem(&quickfs);
+	if (ret) {
+		goto out_zlib;
+	}
+	return 0;
+
+out_zlib:
+	quickfs_zlib_exit();
+out_inodecache:
+	quickfs_destroy_inodecache();
+	return ret;
 }
 
 static void __exit quickfs_exit(void) {
 	unregister_filesystem(&quickfs);
+	quickfs_zlib_exit();
+	quickfs_destroy_inodecache();
 }
 
 module_init(quickfs_init);
@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <linux/fs.h>
+#include <linux/ioctl.h>
 
 #define QUICKFS_BLOCK_SIZE 512
 #define QUICKFS_BLOCK_SIZE_BITS 9
@@ -15,7 +16,13 @@
 #define INODE_BITMAP_BLOCK_NUM 1
 #define FIRST_DATA_BITMAP_BLOCK_NUM 2
 #define FIRST_INODE_BLOCK_NUM 6
-#define FIRST_DATA_BLOCK_NUM 4102
+#define FIRST_JOURNAL_BLOCK_NUM 4102
+#define NUM_JOURNAL_BLOCKS 256
+#define FIRST_REFCOUNT_BLOCK_NUM (FIRST_JOURNAL_BLOCK_NUM + NUM_JOURNAL_BLOCKS)
+#define NUM_REFCOUNT_BLOCKS 32
+#define FIRST_NAME_TABLE_BLOCK_NUM (FIRST_REFCOUNT_BLOCK_NUM + NUM_REFCOUNT_BLOCKS)
+#define NUM_NAME_TABLE_BLOCKS 128
+#define FIRST_DATA_BLOCK_NUM (FIRST_NAME_TABLE_BLOCK_NUM + NUM_NAME_TABLE_BLOCKS)
 #define MAGIC_NUMBER 0xFEEDD0BB
 
 struct quickfs_sb {
@@ -29,8 +36,69 @@ struct quickfs_sb {
 #define DATA_BIT_NUM_TO_BLOCK_NUM(NUM) (FIRST_DATA_BLOCK_NUM + NUM)
 #define DATA_BIT_TO_DATA_BITMAP_BLOCK(INDEX) (INDEX / (8 * QUICKFS_BLOCK_SIZE))
 #define DATA_BIT_TO_INDEX(INDEX) (INDEX % (8 * QUICKFS_BLOCK_SIZE))
+
+/*
+ * Data blocks can be shared between files by dedupquickfs. The refcount
+ * region holds a byte per data block counting the references it has beyond
+ * the first, so a block is shared when its byte is nonzero and a freshly
+ * zeroed region means nothing is shared.
+ */
+#define MAX_BLOCK_REFCOUNT 255
+#define DATA_BIT_TO_REFCOUNT_BLOCK(INDEX) (FIRST_REFCOUNT_BLOCK_NUM + (INDEX) / QUICKFS_BLOCK_SIZE)
+#define DATA_BIT_TO_REFCOUNT_INDEX(INDEX) ((INDEX) % QUICKFS_BLOCK_SIZE)
+
+/*
+ * Every name in the filesystem, whether held by a primary inode or a hard
+ * link record, has an entry in an open-addressed hash table mapping the
+ * hash of the name to the disk inode holding it. Collisions are resolved
+ * by linear probing. With twice as many slots as inodes, a lookup almost
+ * always reads one table block and one inode block.
+ */
+struct quickfs_name_entry {
+	unsigned int hash;
+	unsigned short ino;		// NAME_TABLE_EMPTY or NAME_TABLE_DELETED if unused
+	unsigned short reserved;
+};
+
+#define NAME_TABLE_EMPTY 0xFFFF
+#define NAME_TABLE_DELETED 0xFFFE
+#define NAME_ENTRIES_PER_BLOCK (QUICKFS_BLOCK_SIZE / sizeof(struct quickfs_name_entry))
+#define NAME_TABLE_SLOTS (NUM_NAME_TABLE_BLOCKS * NAME_ENTRIES_PER_BLOCK)
+
+// 32-bit FNV-1a
+static inline unsigned int quickfs_name_hash(const char *name, unsigned int len) {
+
+	unsigned int hash = 2166136261U;
+	unsigned int i;
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
 #define MAX_NAME_LENGTH 256
 #define MAX_DATA_BLOCKS_PER_INODE 104
+
+/*
+ * Data bit numbers fit in 14 bits, so the top bit of a data_blocks entry
+ * marks a preallocated block that hasn't been written yet
+ */
+#define DATA_BLOCK_UNWRITTEN 0x8000
+#define DATA_BLOCK_BIT(ENTRY) ((ENTRY) & ~DATA_BLOCK_UNWRITTEN)
+
+// An entry with no block behind it, which reads as zeros
+#define DATA_BLOCK_HOLE 0x7FFF
+
+/*
+ * Compressed files are stored in clusters of QUICKFS_CLUSTER_BLOCKS entries
+ * of data_blocks, one cluster per page
+ */
+#define QUICKFS_CLUSTER_SIZE 4096
+#define QUICKFS_CLUSTER_BLOCKS (QUICKFS_CLUSTER_SIZE / QUICKFS_BLOCK_SIZE)
+
+// Inode flags
+#define QUICKFS_COMPRESS_FL 0x0001
+#define QUICKFS_USER_FLAGS QUICKFS_COMPRESS_FL
 struct quickfs_inode {
 
 	char name[MAX_NAME_LENGTH];
@@ -39,7 +107,8 @@ struct quickfs_inode {
 	unsigned short data_block_count;
 	unsigned short data_blocks[MAX_DATA_BLOCKS_PER_INODE];
 
-	unsigned long hard_links;
+	unsigned short hard_links;
+	unsigned short flags;
 	short link;
 
 	uid_t uid;
@@ -52,5 +121,127 @@ struct quickfs_inode {
 
 };
 
+/*
+ * ioctls on quickfs files
+ *
+ * QUICKFS_IOC_PREALLOCATE takes a pointer to a loff_t length and reserves
+ * enough blocks for the file to hold that many bytes, without changing
+ * its size
+ *
+ * QUICKFS_IOC_GETFLAGS and QUICKFS_IOC_SETFLAGS read and write the
+ * QUICKFS_USER_FLAGS of a file or of the root directory through a
+ * pointer to an int
+ *
+ * QUICKFS_IOC_READTRACE moves the oldest records of the operation trace
+ * into a quickfs_trace_buffer, on any file of a filesystem mounted with
+ * -o trace, and returns how many it moved
+ *
+ * QUICKFS_IOC_SEEK_DATA and QUICKFS_IOC_SEEK_HOLE take a pointer to a
+ * loff_t offset and replace it with where lseek's SEEK_DATA or SEEK_HOLE
+ * would land, without moving the file position, for kernels whose lseek
+ * doesn't pass those through
+ *
+ * QUICKFS_IOC_BATCH runs a quickfs_batch of creates, links and unlinks on
+ * the root directory in order, sets each op's result, and returns how
+ * many succeeded
+ */
+#define QUICKFS_IOC_MAGIC 'q'
+#define QUICKFS_IOC_PREALLOCATE _IOW(QUICKFS_IOC_MAGIC, 1, loff_t)
+#define QUICKFS_IOC_GETFLAGS _IOR(QUICKFS_IOC_MAGIC, 2, int)
+#define QUICKFS_IOC_SETFLAGS _IOW(QUICKFS_IOC_MAGIC, 3, int)
+#define QUICKFS_IOC_READTRACE _IOWR(QUICKFS_IOC_MAGIC, 4, struct quickfs_trace_buffer)
+#define QUICKFS_IOC_BATCH _IOWR(QUICKFS_IOC_MAGIC, 5, struct quickfs_batch)
+#define QUICKFS_IOC_SEEK_DATA _IOWR(QUICKFS_IOC_MAGIC, 6, loff_t)
+#define QUICKFS_IOC_SEEK_HOLE _IOWR(QUICKFS_IOC_MAGIC, 7, loff_t)
+
+/*
+ * One record per create, link, unlink, read, write or truncate. ino is
+ * the inode the operation acted on, which for a link is the inode the
+ * new name refers to. offset is the new size for a truncate.
+ */
+#define QUICKFS_TRACE_CREATE 1
+#define QUICKFS_TRACE_LINK 2
+#define QUICKFS_TRACE_UNLINK 3
+#define QUICKFS_TRACE_READ 4
+#define QUICKFS_TRACE_WRITE 5
+#define QUICKFS_TRACE_TRUNCATE 6
+
+struct quickfs_trace_record {
+	unsigned long long timestamp;	// Microseconds since the epoch
+	unsigned int offset;
+	unsigned int length;
+	unsigned short op;
+	unsigned short ino;
+	unsigned int reserved;
+	char name[MAX_NAME_LENGTH];
+};
+
+struct quickfs_trace_buffer {
+	struct quickfs_trace_record *records;
+	unsigned int count;		// Room in records
+	unsigned int dropped;		// Set to the records lost to a full trace since the last read
+};
+
+/*
+ * Disk inodes for all the creates and links in a batch come from one pass
+ * over the inode bitmap, and the superblock's free count is written once
+ * per journal handle rather than once per op.
+ */
+#define QUICKFS_BATCH_CREATE 1
+#define QUICKFS_BATCH_LINK 2
+#define QUICKFS_BATCH_UNLINK 3
+#define QUICKFS_BATCH_MAX 1024
+
+struct quickfs_batch_op {
+	int op;
+	int mode;			// Permission bits of a created file, less the umask
+	int result;			// Set to 0 or a negative errno
+	char name[MAX_NAME_LENGTH];
+	char target[MAX_NAME_LENGTH];	// Existing name a link refers to
+};
+
+struct quickfs_batch {
+	struct quickfs_batch_op *ops;
+	unsigned int count;
+};
+
+/*
+ * The journal region starts with a quickfs_journal_sb. Every other block
+ * in the region is a log block. A committed transaction is written to
+ * consecutive log blocks as one descriptor block, a copy of every
+ * metadata block the transaction changed, and a commit block.
+ */
+#define JOURNAL_MAGIC_NUMBER 0xFEEDC0DE
+#define JOURNAL_SUPER_BLOCK_NUM FIRST_JOURNAL_BLOCK_NUM
+#define JOURNAL_LOG_TO_BLOCK_NUM(NUM) (FIRST_JOURNAL_BLOCK_NUM + NUM)
+#define JOURNAL_DESCRIPTOR_BLOCK 1
+#define JOURNAL_COMMIT_BLOCK 2
+
+struct quickfs_journal_sb {
+	unsigned long magic_number;
+	unsigned long sequence;		// Sequence number of the first transaction to replay
+	unsigned long start;		// Log block of that transaction, 0 if the journal is clean
+};
+
+struct quickfs_journal_header {
+	unsigned long magic_number;
+	unsigned long type;
+	unsigned long sequence;
+	unsigned long count;		// Number of metadata blocks in the transaction
+};
+
+#define JOURNAL_TAGS_PER_DESCRIPTOR \
+	((QUICKFS_BLOCK_SIZE - sizeof(struct quickfs_journal_header)) / sizeof(unsigned long))
+
+struct quickfs_journal_descriptor {
+	struct quickfs_journal_header header;
+	unsigned long block_nums[JOURNAL_TAGS_PER_DESCRIPTOR];
+};
+
+struct quickfs_journal_commit {
+	struct quickfs_journal_header header;
+	unsigned long checksum;		// crc32 of the descriptor and every logged block
+};
+
 #endif
 
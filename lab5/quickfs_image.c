@@ -0,0 +1,248 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "quickfs_image.h"
+
+int bitmap_test(const unsigned char *bitmap, int index) {
+	return !!(bitmap[index / 8] & (0x80 >> (index % 8)));
+}
+
+void bitmap_set(unsigned char *bitmap, int index) {
+	bitmap[index / 8] |= (0x80 >> (index % 8));
+}
+
+void bitmap_clear(unsigned char *bitmap, int index) {
+	bitmap[index / 8] &= ~(0x80 >> (index % 8));
+}
+
+int image_read_blocks(struct quickfs_image *image, unsigned long block, unsigned long count, void *buf) {
+
+	size_t length = count * QUICKFS_BLOCK_SIZE;
+	if (pread(image->fd, buf, length, (off_t) block * QUICKFS_BLOCK_SIZE) != length) {
+		return -1;
+	}
+	return 0;
+}
+
+int image_write_blocks(struct quickfs_image *image, unsigned long block, unsigned long count, const void *buf) {
+
+	size_t length = count * QUICKFS_BLOCK_SIZE;
+	if (pwrite(image->fd, buf, length, (off_t) block * QUICKFS_BLOCK_SIZE) != length) {
+		return -1;
+	}
+	return 0;
+}
+
+int image_read_inode(struct quickfs_image *image, int ino, struct quickfs_inode *inode) {
+
+	off_t pos = (off_t) INODE_NUM_TO_BLOCK_NUM(ino) * QUICKFS_BLOCK_SIZE;
+	if (pread(image->fd, inode, sizeof(struct quickfs_inode), pos) != sizeof(struct quickfs_inode)) {
+		return -1;
+	}
+	return 0;
+}
+
+int image_write_inode(struct quickfs_image *image, int ino, const struct quickfs_inode *inode) {
+
+	// Inodes are a block each, so this is a single sector-aligned write
+	off_t pos = (off_t) INODE_NUM_TO_BLOCK_NUM(ino) * QUICKFS_BLOCK_SIZE;
+	if (pwrite(image->fd, inode, sizeof(struct quickfs_inode), pos) != sizeof(struct quickfs_inode)) {
+		return -1;
+	}
+	return 0;
+}
+
+int image_write_bitmaps(struct quickfs_image *image) {
+
+	if (image_write_blocks(image, INODE_BITMAP_BLOCK_NUM, NUM_INODE_BITMAP_BLOCKS, image->inode_bitmap)) return -1;
+	return image_write_blocks(image, FIRST_DATA_BITMAP_BLOCK_NUM, NUM_DATA_BITMAP_BLOCKS, image->data_bitmap);
+}
+
+int image_write_refcounts(struct quickfs_image *image) {
+	return image_write_blocks(image, FIRST_REFCOUNT_BLOCK_NUM, NUM_REFCOUNT_BLOCKS, image->refcounts);
+}
+
+int image_write_superblock(struct quickfs_image *image) {
+
+	unsigned char block[QUICKFS_BLOCK_SIZE];
+	if (image_read_blocks(image, SUPER_BLOCK_BLOCK_NUM, 1, block)) return -1;
+	memcpy(block, &image->sb, sizeof(struct quickfs_sb));
+	return image_write_blocks(image, SUPER_BLOCK_BLOCK_NUM, 1, block);
+}
+
+int image_sync(struct quickfs_image *image) {
+	return fsync(image->fd);
+}
+
+int image_open(struct quickfs_image *image, const char *path, int writable) {
+
+	unsigned char block[QUICKFS_BLOCK_SIZE];
+
+	image->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (image->fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return -1;
+	}
+
+	if (image_read_blocks(image, SUPER_BLOCK_BLOCK_NUM, 1, block)) goto out_error;
+	memcpy(&image->sb, block, sizeof(struct quickfs_sb));
+	if (image->sb.magic_number != MAGIC_NUMBER) {
+		fprintf(stderr, "%s is not a quickfs image\n", path);
+		goto out_error;
+	}
+
+	/*
+	 * Metadata still sitting in the journal hasn't reached its home
+	 * location yet, so the image can't be trusted until it's replayed
+	 */
+	if (image_read_blocks(image, JOURNAL_SUPER_BLOCK_NUM, 1, block)) goto out_error;
+	struct quickfs_journal_sb *jsb = (struct quickfs_journal_sb *) block;
+	if (jsb->magic_number != JOURNAL_MAGIC_NUMBER) {
+		fprintf(stderr, "%s has no journal, reformat it with mkquickfs\n", path);
+		goto out_error;
+	}
+	if (jsb->start) {
+		fprintf(stderr, "%s is mounted or wasn't unmounted cleanly, mount it once to replay the journal\n", path);
+		goto out_error;
+	}
+
+	if (image_read_blocks(image, INODE_BITMAP_BLOCK_NUM, NUM_INODE_BITMAP_BLOCKS, image->inode_bitmap)) goto out_error;
+	if (image_read_blocks(image, FIRST_DATA_BITMAP_BLOCK_NUM, NUM_DATA_BITMAP_BLOCKS, image->data_bitmap)) goto out_error;
+	if (image_read_blocks(image, FIRST_REFCOUNT_BLOCK_NUM, NUM_REFCOUNT_BLOCKS, image->refcounts)) goto out_error;
+
+	return 0;
+
+out_error:
+	close(image->fd);
+	return -1;
+}
+
+void image_close(struct quickfs_image *image) {
+	close(image->fd);
+}
+
+int inode_owns_data(int ino, const struct quickfs_inode *inode) {
+	return ino != ROOT_INODE_NUM && inode->link <= 0;
+}
+
+int inode_run_count(const struct quickfs_inode *inode) {
+
+	int runs = 0;
+	int i;
+	for (i = 0; i < inode->data_block_count; ++i) {
+		if (inode->data_blocks[i] == DATA_BLOCK_HOLE) continue;
+		if (i == 0 || inode->data_blocks[i - 1] == DATA_BLOCK_HOLE ||
+			DATA_BLOCK_BIT(inode->data_blocks[i]) != DATA_BLOCK_BIT(inode->data_blocks[i - 1]) + 1)
+		{
+			runs++;
+		}
+	}
+	return runs;
+}
+
+int inode_shares_blocks(struct quickfs_image *image, const struct quickfs_inode *inode) {
+
+	int i;
+	for (i = 0; i < inode->data_block_count; ++i) {
+		if (inode->data_blocks[i] == DATA_BLOCK_HOLE) continue;
+		if (image->refcounts[DATA_BLOCK_BIT(inode->data_blocks[i])]) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Prints how long the runs of contiguous data blocks in every file are,
+ * bucketed by powers of two
+ */
+void image_report_runs(struct quickfs_image *image, FILE *out) {
+
+	unsigned long buckets[7] = {0};
+	unsigned long files = 0, blocks = 0, runs = 0;
+
+	int ino;
+	for (ino = 0; ino < MAX_NUMBER_INODES; ++ino) {
+		struct quickfs_inode inode;
+		if (!bitmap_test(image->inode_bitmap, ino)) continue;
+		if (image_read_inode(image, ino, &inode)) continue;
+		if (!inode_owns_data(ino, &inode)) continue;
+
+		int i = 0;
+		while (i < inode.data_block_count) {
+			if (inode.data_blocks[i] == DATA_BLOCK_HOLE) {
+				i++;
+				continue;
+			}
+			int length = 1;
+			while (i + length < inode.data_block_count &&
+				inode.data_blocks[i + length] != DATA_BLOCK_HOLE &&
+				DATA_BLOCK_BIT(inode.data_blocks[i + length]) == DATA_BLOCK_BIT(inode.data_blocks[i]) + length)
+			{
+				length++;
+			}
+
+			int bucket = 0;
+			while (bucket < 6 && (2 << bucket) <= length) bucket++;
+			buckets[bucket]++;
+			blocks += length;
+			runs++;
+			i += length;
+		}
+		if (inode.data_block_count) files++;
+	}
+
+	fprintf(out, "%lu files, %lu blocks in %lu runs", files, blocks, runs);
+	if (runs) fprintf(out, ", %.2f blocks per run", (double) blocks / runs);
+	fprintf(out, "\n");
+
+	int bucket;
+	for (bucket = 0; bucket < 7; ++bucket) {
+		if (bucket < 6) {
+			fprintf(out, "  %3d-%-3d blocks: %lu runs\n", 1 << bucket, (2 << bucket) - 1, buckets[bucket]);
+		}
+		else {
+			fprintf(out, "  %3d+    blocks: %lu runs\n", 1 << bucket, buckets[bucket]);
+		}
+	}
+}
+
+/*
+ * Prints how many inodes and data blocks the bitmaps and the superblock
+ * consider free, and how the free data blocks are laid out
+ */
+void image_report_free(struct quickfs_image *image, FILE *out) {
+
+	int inodes_used = 0;
+	int ino;
+	for (ino = 0; ino < MAX_NUMBER_INODES; ++ino) {
+		if (bitmap_test(image->inode_bitmap, ino)) inodes_used++;
+	}
+
+	// Bits past the end of a small image are set by mkquickfs, so count free ones
+	unsigned long blocks_free = 0, free_runs = 0, longest = 0, run = 0;
+	int bit;
+	for (bit = 0; bit < IMAGE_DATA_BITS; ++bit) {
+		if (bitmap_test(image->data_bitmap, bit)) {
+			run = 0;
+			continue;
+		}
+		blocks_free++;
+		if (run++ == 0) free_runs++;
+		if (run > longest) longest = run;
+	}
+
+	fprintf(out, "inodes: %d free in bitmap, %lu in superblock\n",
+		MAX_NUMBER_INODES - inodes_used, (unsigned long) image->sb.inodes_free);
+	fprintf(out, "data blocks: %lu free in bitmap, %lu in superblock\n",
+		blocks_free, (unsigned long) image->sb.data_blocks_free);
+	fprintf(out, "free space: %lu runs, longest %lu blocks\n", free_runs, longest);
+
+	unsigned long shared = 0, references = 0;
+	for (bit = 0; bit < IMAGE_DATA_BITS; ++bit) {
+		if (!image->refcounts[bit]) continue;
+		shared++;
+		references += image->refcounts[bit];
+	}
+	if (shared) fprintf(out, "shared: %lu blocks standing in for %lu more\n", shared, references);
+}
@@ -0,0 +1,45 @@
+#ifndef QUICKFS_IMAGE_HEADER
+#define QUICKFS_IMAGE_HEADER
+
+#include <stdio.h>
+#include <time.h>
+#include "quickfs.h"
+
+/*
+ * Direct access to an unmounted quickfs image, for the userspace tools
+ */
+struct quickfs_image {
+	int fd;
+	struct quickfs_sb sb;
+	unsigned char inode_bitmap[NUM_INODE_BITMAP_BLOCKS * QUICKFS_BLOCK_SIZE];
+	unsigned char data_bitmap[NUM_DATA_BITMAP_BLOCKS * QUICKFS_BLOCK_SIZE];
+	unsigned char refcounts[NUM_REFCOUNT_BLOCKS * QUICKFS_BLOCK_SIZE];
+};
+
+#define IMAGE_DATA_BITS (NUM_DATA_BITMAP_BLOCKS * QUICKFS_BLOCK_SIZE * 8)
+
+int image_open(struct quickfs_image *image, const char *path, int writable);
+void image_close(struct quickfs_image *image);
+
+int image_read_blocks(struct quickfs_image *image, unsigned long block, unsigned long count, void *buf);
+int image_write_blocks(struct quickfs_image *image, unsigned long block, unsigned long count, const void *buf);
+int image_read_inode(struct quickfs_image *image, int ino, struct quickfs_inode *inode);
+int image_write_inode(struct quickfs_image *image, int ino, const struct quickfs_inode *inode);
+int image_write_bitmaps(struct quickfs_image *image);
+int image_write_refcounts(struct quickfs_image *image);
+int image_write_superblock(struct quickfs_image *image);
+int image_sync(struct quickfs_image *image);
+
+int bitmap_test(const unsigned char *bitmap, int index);
+void bitmap_set(unsigned char *bitmap, int index);
+void bitmap_clear(unsigned char *bitmap, int index);
+
+// An inode that owns data blocks, rather than a hard link record or the root
+int inode_owns_data(int ino, const struct quickfs_inode *inode);
+int inode_run_count(const struct quickfs_inode *inode);
+int inode_shares_blocks(struct quickfs_image *image, const struct quickfs_inode *inode);
+
+void image_report_runs(struct quickfs_image *image, FILE *out);
+void image_report_free(struct quickfs_image *image, FILE *out);
+
+#endif
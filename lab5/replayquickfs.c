@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "quickfs_image.h"
+
+/*
+ * Replays a trace from tracequickfs against a mounted quickfs, normally a
+ * freshly made one, and reports the latency of every kind of operation.
+ * Operations run back to back, or with -t at the spacing they were traced
+ * with. Reads and writes open the file by name each time, so their latency
+ * includes the lookup. With -i, the filesystem is unmounted afterwards and
+ * the image is checked for fragmentation and free space.
+ */
+
+#define NUM_OPS (QUICKFS_TRACE_TRUNCATE + 1)
+
+static const char *op_names[NUM_OPS] = {
+	[QUICKFS_TRACE_CREATE] = "create",
+	[QUICKFS_TRACE_LINK] = "link",
+	[QUICKFS_TRACE_UNLINK] = "unlink",
+	[QUICKFS_TRACE_READ] = "read",
+	[QUICKFS_TRACE_WRITE] = "write",
+	[QUICKFS_TRACE_TRUNCATE] = "truncate"
+};
+
+struct op_stats {
+	unsigned long count;
+	unsigned long done;
+	unsigned long errors;
+	unsigned long long bytes;
+	unsigned long long *latencies;	// Nanoseconds, one per successful operation
+};
+
+// The name each traced inode can currently be reached by
+static char names[MAX_NUMBER_INODES][MAX_NAME_LENGTH];
+
+static unsigned long long now_ns(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int by_value(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int replay_one(int dir_fd, const struct quickfs_trace_record *record, char *buf) {
+
+	const char *name = record->name;
+	int fd, ret;
+	ssize_t n;
+
+	switch (record->op) {
+		case QUICKFS_TRACE_CREATE:
+			fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (fd < 0) return -1;
+			return close(fd);
+
+		case QUICKFS_TRACE_LINK:
+			if (!names[record->ino][0]) {
+				errno = ENOENT;
+				return -1;
+			}
+			return linkat(dir_fd, names[record->ino], dir_fd, name, 0);
+
+		case QUICKFS_TRACE_UNLINK:
+			return unlinkat(dir_fd, name, 0);
+
+		case QUICKFS_TRACE_READ:
+			fd = openat(dir_fd, name, O_RDONLY);
+			if (fd < 0) return -1;
+			n = pread(fd, buf, record->length, record->offset);
+			close(fd);
+			return n < 0 ? -1 : 0;
+
+		case QUICKFS_TRACE_WRITE:
+			fd = openat(dir_fd, name, O_WRONLY | O_CREAT, 0644);
+			if (fd < 0) return -1;
+			n = pwrite(fd, buf, record->length, record->offset);
+			ret = n == record->length ? 0 : -1;
+			if (close(fd)) ret = -1;
+			return ret;
+
+		case QUICKFS_TRACE_TRUNCATE:
+			if (!names[record->ino][0]) {
+				errno = ENOENT;
+				return -1;
+			}
+			fd = openat(dir_fd, names[record->ino], O_WRONLY);
+			if (fd < 0) return -1;
+			ret = ftruncate(fd, record->offset);
+			if (close(fd)) ret = -1;
+			return ret;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Keeps names[] pointing at a name that still exists after a record has
+ * been replayed. When that name is unlinked, the inode is still reachable
+ * by any other name it was given earlier in the trace.
+ */
+static void track_names(int dir_fd, const struct quickfs_trace_record *records, size_t index) {
+
+	const struct quickfs_trace_record *record = &records[index];
+	char *current = names[record->ino];
+
+	if (record->op != QUICKFS_TRACE_UNLINK) {
+		if (record->name[0] && (record->op != QUICKFS_TRACE_LINK || !current[0])) {
+			strcpy(current, record->name);
+		}
+		return;
+	}
+	if (strcmp(current, record->name)) return;
+
+	current[0] = '\0';
+	while (index-- > 0) {
+		const struct quickfs_trace_record *earlier = &records[index];
+		if (earlier->ino == record->ino && earlier->name[0] && earlier->op != QUICKFS_TRACE_UNLINK &&
+			!faccessat(dir_fd, earlier->name, F_OK, 0))
+		{
+			strcpy(current, earlier->name);
+			return;
+		}
+	}
+}
+
+static void report_latencies(struct op_stats *stats) {
+
+	printf("%-9s %8s %7s %10s %10s %10s %10s\n", "op", "count", "errors", "mean us", "p50 us", "p99 us", "max us");
+
+	int op;
+	for (op = 1; op < NUM_OPS; ++op) {
+		struct op_stats *s = &stats[op];
+		if (!s->count) continue;
+
+		unsigned long done = s->done;
+		unsigned long long total = 0;
+		unsigned long i;
+		for (i = 0; i < done; ++i) total += s->latencies[i];
+		qsort(s->latencies, done, sizeof(unsigned long long), by_value);
+
+		if (done) {
+			printf("%-9s %8lu %7lu %10.1f %10.1f %10.1f %10.1f", op_names[op], s->count, s->errors,
+				total / 1000.0 / done, s->latencies[done / 2] / 1000.0,
+				s->latencies[done * 99 / 100] / 1000.0, s->latencies[done - 1] / 1000.0);
+		}
+		else {
+			printf("%-9s %8lu %7lu %10s %10s %10s %10s", op_names[op], s->count, s->errors, "-", "-", "-", "-");
+		}
+		if (s->bytes) printf("  %llu bytes", s->bytes);
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	int timed = 0;
+	const char *image_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "ti:")) != -1) {
+		if (opt == 't') {
+			timed = 1;
+		}
+		else if (opt == 'i') {
+			image_path = optarg;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 2) goto usage;
+	const char *trace_path = argv[optind];
+	const char *mountpoint = argv[optind + 1];
+
+	// Read the whole trace up front so file reads don't disturb the timing
+	FILE *trace = fopen(trace_path, "r");
+	if (!trace) {
+		fprintf(stderr, "Couldn't open %s\n", trace_path);
+		goto out_error;
+	}
+	struct stat st;
+	if (fstat(fileno(trace), &st)) goto out_error;
+	size_t count = st.st_size / sizeof(struct quickfs_trace_record);
+	struct quickfs_trace_record *records = malloc(count * sizeof(struct quickfs_trace_record) + 1);
+	if (!records || fread(records, sizeof(struct quickfs_trace_record), count, trace) != count) {
+		fprintf(stderr, "Couldn't read %s\n", trace_path);
+		goto out_error;
+	}
+	fclose(trace);
+
+	struct op_stats stats[NUM_OPS];
+	memset(stats, 0, sizeof(stats));
+	size_t max_length = 0;
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		records[i].name[MAX_NAME_LENGTH - 1] = '\0';
+		if (records[i].op == 0 || records[i].op >= NUM_OPS || records[i].ino >= MAX_NUMBER_INODES) {
+			fprintf(stderr, "Record %zu is not a trace record\n", i);
+			goto out_error;
+		}
+		stats[records[i].op].count++;
+		if (records[i].length > max_length) max_length = records[i].length;
+	}
+
+	int op;
+	for (op = 1; op < NUM_OPS; ++op) {
+		stats[op].latencies = malloc(stats[op].count * sizeof(unsigned long long) + 1);
+		if (!stats[op].latencies) goto out_error;
+	}
+	char *buf = malloc(max_length + 1);
+	if (!buf) goto out_error;
+	memset(buf, 'q', max_length);
+
+	int dir_fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", mountpoint);
+		goto out_error;
+	}
+
+	unsigned long long start = now_ns();
+	for (i = 0; i < count; ++i) {
+		const struct quickfs_trace_record *record = &records[i];
+		struct op_stats *s = &stats[record->op];
+
+		if (timed) {
+			unsigned long long due = start + (record->timestamp - records[0].timestamp) * 1000ULL;
+			unsigned long long t = now_ns();
+			if (due > t) {
+				struct timespec wait = { (due - t) / 1000000000ULL, (due - t) % 1000000000ULL };
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		unsigned long long before = now_ns();
+		if (replay_one(dir_fd, record, buf)) {
+			if (s->errors++ == 0) {
+				fprintf(stderr, "%s %s failed: %s\n", op_names[record->op], record->name, strerror(errno));
+			}
+			continue;
+		}
+		s->latencies[s->done++] = now_ns() - before;
+		track_names(dir_fd, records, i);
+		if (record->op == QUICKFS_TRACE_READ || record->op == QUICKFS_TRACE_WRITE) s->bytes += record->length;
+	}
+	unsigned long long elapsed = now_ns() - start;
+
+	// Get the replayed data and metadata onto the disk before looking at it
+	close(dir_fd);
+	sync();
+
+	printf("Replayed %zu operations in %.3f s\n", count, elapsed / 1e9);
+	report_latencies(stats);
+
+	if (image_path) {
+		if (umount(mountpoint)) {
+			fprintf(stderr, "Couldn't unmount %s: %s\n", mountpoint, strerror(errno));
+			goto out_error;
+		}
+
+		struct quickfs_image image;
+		if (image_open(&image, image_path, 0)) goto out_error;
+		printf("\nFragmentation:\n");
+		image_report_runs(&image, stdout);
+		printf("\nBitmaps:\n");
+		image_report_free(&image, stdout);
+		image_close(&image);
+	}
+	return 0;
+
+out_error:
+	fprintf(stderr, "Trace could not be replayed\n");
+	return -1;
+usage:
+	fprintf(stderr, "usage: replayquickfs [-t] [-i image] trace mountpoint\n");
+	return -1;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Loopback benchmark for serving files off a mounted quickfs. Every file is
+ * sent to a client over a TCP connection to 127.0.0.1 with a read/write
+ * loop, with sendfile and with splice through a pipe, then received back
+ * into a new file next to it with a read/write loop and with splice. The
+ * client is a separate process, so the CPU time this process uses is the
+ * cost of serving, and the methods are compared by CPU time per byte.
+ */
+
+#define CHUNK 65536
+#define DEFAULT_ROUNDS 200
+
+enum { SERVE, RECEIVE };
+
+static const char *direction_names[] = { "serve", "receive" };
+
+static char buffer[CHUNK];
+static int pipe_fds[2];
+
+static int write_all(int fd, const char *data, size_t length) {
+
+	while (length) {
+		ssize_t n = write(fd, data, length);
+		if (n <= 0) return -1;
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static ssize_t serve_rw(int fd, int sock, size_t size) {
+
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = pread(fd, buffer, CHUNK, done);
+		if (n < 0) return -1;
+		if (!n) break;
+		if (write_all(sock, buffer, n)) return -1;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t serve_sendfile(int fd, int sock, size_t size) {
+
+	off_t offset = 0;
+	while (offset < size) {
+		ssize_t n = sendfile(sock, fd, &offset, size - offset);
+		if (n < 0) return -1;
+		if (!n) break;
+	}
+	return offset;
+}
+
+static ssize_t serve_splice(int fd, int sock, size_t size) {
+
+	loff_t offset = 0;
+	while (offset < size) {
+		ssize_t n = splice(fd, &offset, pipe_fds[1], NULL, CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0) return -1;
+		if (!n) break;
+		while (n > 0) {
+			ssize_t moved = splice(pipe_fds[0], NULL, sock, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (moved <= 0) return -1;
+			n -= moved;
+		}
+	}
+	return offset;
+}
+
+static ssize_t receive_rw(int fd, int sock, size_t size) {
+
+	size_t done = 0;
+	for (;;) {
+		ssize_t n = read(sock, buffer, CHUNK);
+		if (n < 0) return -1;
+		if (!n) break;
+		if (write_all(fd, buffer, n)) return -1;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t receive_splice(int fd, int sock, size_t size) {
+
+	loff_t offset = 0;
+	for (;;) {
+		ssize_t n = splice(sock, NULL, pipe_fds[1], NULL, CHUNK, SPLICE_F_MOVE);
+		if (n < 0) return -1;
+		if (!n) break;
+		while (n > 0) {
+			ssize_t moved = splice(pipe_fds[0], NULL, fd, &offset, n, SPLICE_F_MOVE);
+			if (moved <= 0) return -1;
+			n -= moved;
+		}
+	}
+	return offset;
+}
+
+struct method {
+	const char *name;
+	int direction;
+	ssize_t (*run)(int fd, int sock, size_t size);
+};
+
+// The first method of each direction is the baseline for the others
+static const struct method methods[] = {
+	{ "read/write", SERVE, serve_rw },
+	{ "sendfile", SERVE, serve_sendfile },
+	{ "splice", SERVE, serve_splice },
+	{ "read/write", RECEIVE, receive_rw },
+	{ "splice", RECEIVE, receive_splice }
+};
+
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+struct result {
+	unsigned long long bytes;
+	unsigned long long wall_ns;
+	unsigned long long cpu_ns;
+	int error;		// errno of a failed transfer, 0 if all of them worked
+};
+
+static unsigned long long now_ns(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long cpu_ns(void) {
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (unsigned long long) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+		(unsigned long long) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+// Connects rounds times, draining what is served or sending size bytes to be received
+static void client(const struct sockaddr_in *addr, int direction, size_t size, int rounds) {
+
+	int round;
+	for (round = 0; round < rounds; ++round) {
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock < 0 || connect(sock, (const struct sockaddr *) addr, sizeof(*addr))) _exit(1);
+
+		// Don't hold the last partial segment back waiting on a delayed ACK
+		int nodelay = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		if (direction == SERVE) {
+			while (read(sock, buffer, CHUNK) > 0);
+		}
+		else {
+			size_t done = 0;
+			while (done < size) {
+				size_t length = size - done < CHUNK ? size - done : CHUNK;
+				if (write_all(sock, buffer, length)) _exit(1);
+				done += length;
+			}
+
+			// Wait for the server to finish, so connections don't pile up in its backlog
+			shutdown(sock, SHUT_WR);
+			while (read(sock, buffer, CHUNK) > 0);
+		}
+		close(sock);
+	}
+	_exit(0);
+}
+
+static int bench(const char *path, const char *received, size_t size, const struct method *method, int rounds,
+	int listener, const struct sockaddr_in *addr, struct result *result)
+{
+	memset(result, 0, sizeof(*result));
+	if (pipe(pipe_fds)) return -1;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return -1;
+	}
+	if (!pid) client(addr, method->direction, size, rounds);
+
+	unsigned long long cpu_start = cpu_ns();
+	unsigned long long wall_start = now_ns();
+
+	int round;
+	for (round = 0; round < rounds; ++round) {
+		int conn = accept(listener, NULL, NULL);
+		if (conn < 0) {
+			result->error = errno;
+			break;
+		}
+		int fd = method->direction == SERVE ? open(path, O_RDONLY) :
+			open(received, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		ssize_t moved = fd < 0 ? -1 : method->run(fd, conn, size);
+		if (moved < 0) result->error = errno;
+		if (fd >= 0) close(fd);
+		close(conn);
+		if (moved < 0) break;
+		result->bytes += moved;
+	}
+
+	result->wall_ns = now_ns() - wall_start;
+	result->cpu_ns = cpu_ns() - cpu_start;
+
+	// A failed transfer leaves the client waiting on rounds that won't come
+	if (result->error) kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int rounds = DEFAULT_ROUNDS;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		if (opt == 'r' && atoi(optarg) > 0) {
+			rounds = atoi(optarg);
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind == argc) goto usage;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_length = sizeof(addr);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) || listen(listener, 16) ||
+		getsockname(listener, (struct sockaddr *) &addr, &addr_length))
+	{
+		perror("Couldn't listen on the loopback interface");
+		return -1;
+	}
+
+	int i;
+	for (i = optind; i < argc; ++i) {
+		const char *path = argv[i];
+		struct stat st;
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "%s is not a regular file\n", path);
+			goto out_error;
+		}
+
+		char received[4096];
+		snprintf(received, sizeof(received), "%s.servebench", path);
+
+		// Start with the file in the page cache, as a busy server would
+		int fd = open(path, O_RDONLY);
+		int null_fd = open("/dev/null", O_WRONLY);
+		ssize_t warmed = fd < 0 || null_fd < 0 ? -1 : serve_rw(fd, null_fd, st.st_size);
+		if (fd >= 0) close(fd);
+		if (null_fd >= 0) close(null_fd);
+		if (warmed < 0) {
+			perror(path);
+			goto out_error;
+		}
+
+		printf("%s: %lld bytes, %d rounds\n", path, (long long) st.st_size, rounds);
+
+		double baseline = 0;
+		int m;
+		for (m = 0; m < NUM_METHODS; ++m) {
+			struct result result;
+			if (bench(path, received, st.st_size, &methods[m], rounds, listener, &addr, &result)) {
+				perror("Couldn't start the client");
+				goto out_error;
+			}
+
+			printf("  %-8s %-10s ", direction_names[methods[m].direction], methods[m].name);
+			if (result.error) {
+				printf("failed: %s\n", strerror(result.error));
+				if (!m || methods[m - 1].direction != methods[m].direction) baseline = 0;
+				continue;
+			}
+
+			double per_byte = result.bytes ? (double) result.cpu_ns / result.bytes : 0;
+			printf("%9.1f MB/s %8.3f ns CPU/byte", result.wall_ns ? result.bytes * 1000.0 / result.wall_ns : 0, per_byte);
+			if (!m || methods[m - 1].direction != methods[m].direction) {
+				baseline = per_byte;
+			}
+			else if (baseline > 0) {
+				printf("  %+.0f%% CPU", (per_byte - baseline) * 100 / baseline);
+			}
+			printf("\n");
+		}
+		unlink(received);
+	}
+
+	close(listener);
+	return 0;
+
+out_error:
+	close(listener);
+	return -1;
+usage:
+	fprintf(stderr, "usage: servebench [-r rounds] file...\n");
+	return -1;
+}
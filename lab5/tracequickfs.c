@@ -0,0 +1,100 @@
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "quickfs.h"
+
+/*
+ * Drains the operation trace of a quickfs mounted with -o trace and writes
+ * the records to stdout, in the binary format replayquickfs reads. With -f
+ * it keeps polling until interrupted, otherwise it stops once the trace is
+ * empty.
+ */
+
+#define TRACE_BATCH 256
+#define POLL_INTERVAL_US 100000
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+	stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+
+	int follow = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "f")) != -1) {
+		if (opt == 'f') {
+			follow = 1;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) goto usage;
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "Refusing to write a trace to a terminal\n");
+		goto usage;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", argv[optind]);
+		goto out_error;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	static struct quickfs_trace_record records[TRACE_BATCH];
+	unsigned long total = 0, dropped = 0;
+	int draining = 0;
+	for (;;) {
+		struct quickfs_trace_buffer buffer = { records, TRACE_BATCH, 0 };
+		int count = ioctl(fd, QUICKFS_IOC_READTRACE, &buffer);
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Couldn't read the trace: %s%s\n", strerror(errno),
+				errno == EINVAL ? " (not mounted with -o trace?)" : "");
+			goto out_close;
+		}
+		dropped += buffer.dropped;
+
+		if (count && fwrite(records, sizeof(struct quickfs_trace_record), count, stdout) != count) {
+			fprintf(stderr, "Couldn't write the trace\n");
+			goto out_close;
+		}
+		total += count;
+
+		// One last pass after an interrupt picks up whatever came in meanwhile
+		if (count < TRACE_BATCH) {
+			if (draining || !follow) break;
+			if (stopping) {
+				draining = 1;
+				continue;
+			}
+			usleep(POLL_INTERVAL_US);
+		}
+	}
+
+	if (fflush(stdout)) goto out_close;
+	fprintf(stderr, "%lu records", total);
+	if (dropped) fprintf(stderr, ", %lu dropped because the trace was full", dropped);
+	fprintf(stderr, "\n");
+	close(fd);
+	return 0;
+
+out_close:
+	close(fd);
+out_error:
+	return -1;
+usage:
+	fprintf(stderr, "usage: tracequickfs [-f] mountpoint > trace\n");
+	return -1;
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include "quickfs_image.h"
+
+/*
+ * Tells the storage under an unmounted quickfs image that its free data
+ * blocks are unused. Free blocks are found by walking the data bitmaps, and
+ * each maximal run of at least min_length free blocks becomes one discard:
+ * BLKDISCARD on a block device, or a punched hole in an image file so a
+ * sparse loop file gives the space back to the host filesystem.
+ */
+
+static int discard_run(struct quickfs_image *image, int is_device, unsigned long bit, unsigned long length) {
+
+	uint64_t range[2];
+	range[0] = (uint64_t) DATA_BIT_NUM_TO_BLOCK_NUM(bit) * QUICKFS_BLOCK_SIZE;
+	range[1] = (uint64_t) length * QUICKFS_BLOCK_SIZE;
+
+	if (is_device) {
+		return ioctl(image->fd, BLKDISCARD, range);
+	}
+	return fallocate(image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+}
+
+int main(int argc, char *argv[]) {
+
+	unsigned long min_length = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		if (opt == 'm') {
+			min_length = strtoul(optarg, NULL, 10);
+			if (min_length < 1) min_length = 1;
+		}
+		else {
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) goto usage;
+
+	struct quickfs_image image;
+	if (image_open(&image, argv[optind], 1)) goto out_error;
+
+	struct stat st;
+	if (fstat(image.fd, &st)) goto out_close;
+	int is_device = S_ISBLK(st.st_mode);
+	unsigned long image_blocks = is_device ? 0 : st.st_size / QUICKFS_BLOCK_SIZE;
+
+	unsigned long runs = 0, blocks = 0;
+	unsigned long bit = 0;
+	while (bit < IMAGE_DATA_BITS) {
+		if (bitmap_test(image.data_bitmap, bit)) {
+			bit++;
+			continue;
+		}
+
+		unsigned long length = 1;
+		while (bit + length < IMAGE_DATA_BITS && !bitmap_test(image.data_bitmap, bit + length)) {
+			length++;
+		}
+
+		// mkquickfs marks bits past the end of the image as used, but be safe
+		if (image_blocks && DATA_BIT_NUM_TO_BLOCK_NUM(bit + length) > image_blocks) {
+			length = image_blocks > DATA_BIT_NUM_TO_BLOCK_NUM(bit) ? image_blocks - DATA_BIT_NUM_TO_BLOCK_NUM(bit) : 0;
+		}
+
+		if (length >= min_length) {
+			if (discard_run(&image, is_device, bit, length)) {
+				if (errno == EOPNOTSUPP) {
+					fprintf(stderr, "%s doesn't support discard\n", argv[optind]);
+				}
+				else {
+					perror("discard");
+				}
+				goto out_close;
+			}
+			runs++;
+			blocks += length;
+		}
+		bit += length ? length : 1;
+	}
+
+	if (image_sync(&image)) goto out_close;
+	printf("Discarded %lu free blocks (%lu bytes) in %lu runs\n", blocks, blocks * QUICKFS_BLOCK_SIZE, runs);
+
+	image_close(&image);
+	return 0;
+
+out_close:
+	image_close(&image);
+out_error:
+	fprintf(stderr, "Image could not be trimmed\n");
+	return -1;
+usage:
+	fprintf(stderr, "usage: trimquickfs [-m min_blocks] image\n");
+	return -1;
+}